@@ -0,0 +1,558 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Benchmarks for the allocator. Each run is one backend under one
+ * workload and prints a single line of JSON, so results can be collected
+ * and compared between commits:
+ *
+ *     ./bench -a thin -w churn -t 4 -n 1000000
+ *
+ * Every malloc, free and realloc is timed on its own and dropped into a
+ * log-linear histogram for the latency percentiles. Peak heap use is the
+ * most that was ever mapped from the OS, and fragmentation is how much of
+ * that wasn't covered by the bytes the workload had asked for at the time.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_SLOTS 1024
+#define BENCH_BATCH 128
+#define BENCH_ROUNDS 10
+#define BENCH_RING 1024
+/* Only look at the totals every so often, it means touching every other
+ * thread's counters.
+ */
+#define BENCH_SAMPLE_EVERY 256
+
+/* 16 buckets per power of two, exact below 16 ns.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct worker {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t hist[LAT_BUCKETS];
+    void **slots;
+    size_t *sizes;
+    /* Bytes this thread has asked for and not freed. Can go negative
+     * when another thread frees what this one allocated.
+     */
+    long live __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct ring {
+    void *items[BENCH_RING];
+    size_t sizes[BENCH_RING];
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+};
+
+struct workload {
+    const char *name;
+    void (*run)(struct worker *w);
+};
+
+static int nthreads = 1;
+static uint64_t nops = 1000000;
+static size_t max_size = 512;
+static struct worker workers[BENCH_MAX_THREADS];
+static struct ring rings[BENCH_MAX_THREADS / 2];
+/* start lines the workers up with the clock, round is for the workers
+ * alone.
+ */
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t round_barrier;
+static long peak_live;
+static long peak_mapped;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rnd(struct worker *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static size_t rnd_size(struct worker *w)
+{
+    return rnd(w) % max_size + 1;
+}
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+    unsigned int msb;
+    if (ns < (1 << LAT_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+        + ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Largest latency that lands in bucket b.
+ */
+static uint64_t lat_bucket_max(unsigned int b)
+{
+    unsigned int shift;
+    if (b < (1 << LAT_SUB_BITS)) {
+        return b;
+    }
+    shift = (b >> LAT_SUB_BITS) - 1;
+    return ((((uint64_t) 1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1)) + 1) << shift) - 1;
+}
+
+static void max_update(long *peak, long val)
+{
+    long cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (val > cur && !__atomic_compare_exchange_n(peak, &cur, val, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void sample(struct worker *w)
+{
+    long live = 0;
+    int i;
+    if (w->ops % BENCH_SAMPLE_EVERY) {
+        return;
+    }
+    for (i = 0; i < nthreads; i++) {
+        live += __atomic_load_n(&workers[i].live, __ATOMIC_RELAXED);
+    }
+    max_update(&peak_live, live);
+    max_update(&peak_mapped, malloc_mapped_bytes());
+}
+
+static void record(struct worker *w, uint64_t start)
+{
+    w->hist[lat_bucket(now() - start)]++;
+    w->ops++;
+    sample(w);
+}
+
+/* A call that handled n blocks counts as n ops of its average latency.
+ */
+static void record_n(struct worker *w, uint64_t start, size_t n)
+{
+    uint64_t each = (now() - start) / n;
+    w->hist[lat_bucket(each)] += n;
+    w->ops += n;
+    sample(w);
+}
+
+static void *timed_malloc(struct worker *w, size_t sz)
+{
+    uint64_t start = now();
+    char *ret = malloc(sz);
+    record(w, start);
+    if (!ret) {
+        fprintf(stderr, "bench: out of memory allocating %zu bytes\n", sz);
+        exit(1);
+    }
+    /* Make sure the memory is really there, not just promised.
+     */
+    *ret = 1;
+    __atomic_add_fetch(&w->live, sz, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void timed_free(struct worker *w, void *ptr, size_t sz)
+{
+    uint64_t start = now();
+    free(ptr);
+    record(w, start);
+    __atomic_sub_fetch(&w->live, sz, __ATOMIC_RELAXED);
+}
+
+static void *timed_realloc(struct worker *w, void *ptr, size_t old, size_t sz)
+{
+    uint64_t start = now();
+    char *ret = realloc(ptr, sz);
+    record(w, start);
+    if (!ret) {
+        fprintf(stderr, "bench: out of memory reallocating to %zu bytes\n", sz);
+        exit(1);
+    }
+    ret[sz - 1] = 1;
+    __atomic_add_fetch(&w->live, (long) sz - (long) old, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void free_slots(struct worker *w)
+{
+    int i;
+    for (i = 0; i < BENCH_SLOTS; i++) {
+        if (w->slots[i]) {
+            timed_free(w, w->slots[i], w->sizes[i]);
+            w->slots[i] = NULL;
+        }
+    }
+}
+
+/* Random sizes, freed in random order, with the heap hovering around
+ * half full.
+ */
+static void run_churn(struct worker *w)
+{
+    int i;
+    while (w->ops < nops) {
+        i = rnd(w) % BENCH_SLOTS;
+        if (w->slots[i]) {
+            timed_free(w, w->slots[i], w->sizes[i]);
+            w->slots[i] = NULL;
+        } else {
+            w->sizes[i] = rnd_size(w);
+            w->slots[i] = timed_malloc(w, w->sizes[i]);
+        }
+    }
+    free_slots(w);
+}
+
+/* Allocate a batch, free it newest first.
+ */
+static void run_lifo(struct worker *w)
+{
+    int i;
+    while (w->ops < nops) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            w->sizes[i] = rnd_size(w);
+            w->slots[i] = timed_malloc(w, w->sizes[i]);
+        }
+        for (i = BENCH_BATCH - 1; i >= 0; i--) {
+            timed_free(w, w->slots[i], w->sizes[i]);
+        }
+    }
+}
+
+/* Allocate a batch, free it oldest first.
+ */
+static void run_fifo(struct worker *w)
+{
+    int i;
+    while (w->ops < nops) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            w->sizes[i] = rnd_size(w);
+            w->slots[i] = timed_malloc(w, w->sizes[i]);
+        }
+        for (i = 0; i < BENCH_BATCH; i++) {
+            timed_free(w, w->slots[i], w->sizes[i]);
+        }
+    }
+}
+
+/* Like fifo but a batch is all one size and goes through malloc_batch and
+ * free_batch.
+ */
+static void run_batch(struct worker *w)
+{
+    uint64_t start;
+    size_t sz;
+    int i;
+    while (w->ops < nops) {
+        sz = rnd_size(w);
+        start = now();
+        if (malloc_batch(sz, BENCH_BATCH, w->slots) != BENCH_BATCH) {
+            fprintf(stderr, "bench: out of memory allocating %zu bytes\n", sz);
+            exit(1);
+        }
+        record_n(w, start, BENCH_BATCH);
+        for (i = 0; i < BENCH_BATCH; i++) {
+            *(char *) w->slots[i] = 1;
+        }
+        __atomic_add_fetch(&w->live, sz * BENCH_BATCH, __ATOMIC_RELAXED);
+        start = now();
+        free_batch(BENCH_BATCH, w->slots);
+        record_n(w, start, BENCH_BATCH);
+        __atomic_sub_fetch(&w->live, sz * BENCH_BATCH, __ATOMIC_RELAXED);
+    }
+}
+
+/* Like fifo but a batch comes out of a bump arena and goes with one
+ * reset, which counts as a free of each block.
+ */
+static void run_scope(struct worker *w)
+{
+    struct bump_arena *a = bump_arena_create(0);
+    uint64_t start;
+    long live = 0;
+    size_t sz;
+    char *p;
+    int i;
+    if (!a) {
+        fprintf(stderr, "bench: out of memory creating an arena\n");
+        exit(1);
+    }
+    while (w->ops < nops) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            sz = rnd_size(w);
+            start = now();
+            p = bump_arena_alloc(a, sz);
+            record(w, start);
+            if (!p) {
+                fprintf(stderr, "bench: out of memory allocating %zu bytes\n", sz);
+                exit(1);
+            }
+            *p = 1;
+            live += sz;
+            __atomic_add_fetch(&w->live, sz, __ATOMIC_RELAXED);
+        }
+        start = now();
+        bump_arena_reset(a);
+        record_n(w, start, BENCH_BATCH);
+        __atomic_sub_fetch(&w->live, live, __ATOMIC_RELAXED);
+        live = 0;
+    }
+    bump_arena_destroy(a);
+}
+
+/* Threads pair up: the even one only allocates and the odd one frees
+ * everything it's handed, so every block is freed by a thread that
+ * didn't allocate it.
+ */
+static void run_prodcons(struct worker *w)
+{
+    struct ring *ring = &rings[w->id / 2];
+    size_t head, tail;
+    uint64_t n;
+    if (!(w->id & 1)) {
+        for (n = 0; n < nops; n++) {
+            while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+                    - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == BENCH_RING) {
+                sched_yield();
+            }
+            ring->sizes[tail % BENCH_RING] = rnd_size(w);
+            ring->items[tail % BENCH_RING] = timed_malloc(w, ring->sizes[tail % BENCH_RING]);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (n = 0; n < nops; n++) {
+            while ((head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED))
+                    == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+            timed_free(w, ring->items[head % BENCH_RING], ring->sizes[head % BENCH_RING]);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* After Larson and Krishnan: each thread replaces random blocks in its
+ * own set, and between rounds the sets move on to the next thread, so
+ * blocks live across threads and get freed far from where they were
+ * allocated.
+ */
+static void run_larson(struct worker *w)
+{
+    uint64_t per_round = nops / BENCH_ROUNDS;
+    void **slots;
+    size_t *sizes;
+    int round, i;
+    for (i = 0; i < BENCH_SLOTS; i++) {
+        w->sizes[i] = rnd_size(w);
+        w->slots[i] = timed_malloc(w, w->sizes[i]);
+    }
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        while (w->ops < per_round * (round + 1)) {
+            i = rnd(w) % BENCH_SLOTS;
+            timed_free(w, w->slots[i], w->sizes[i]);
+            w->sizes[i] = rnd_size(w);
+            w->slots[i] = timed_malloc(w, w->sizes[i]);
+        }
+        pthread_barrier_wait(&round_barrier);
+        if (!w->id) {
+            slots = workers[0].slots;
+            sizes = workers[0].sizes;
+            for (i = 1; i < nthreads; i++) {
+                workers[i - 1].slots = workers[i].slots;
+                workers[i - 1].sizes = workers[i].sizes;
+            }
+            workers[nthreads - 1].slots = slots;
+            workers[nthreads - 1].sizes = sizes;
+        }
+        pthread_barrier_wait(&round_barrier);
+    }
+    free_slots(w);
+}
+
+/* Buffers that keep growing by half until they're big, then start over,
+ * plus the odd shrink.
+ */
+static void run_realloc(struct worker *w)
+{
+    size_t sz;
+    int i;
+    while (w->ops < nops) {
+        i = rnd(w) % BENCH_SLOTS;
+        if (!w->slots[i]) {
+            w->sizes[i] = rnd_size(w);
+            w->slots[i] = timed_malloc(w, w->sizes[i]);
+        } else if (w->sizes[i] > 64 * max_size) {
+            timed_free(w, w->slots[i], w->sizes[i]);
+            w->slots[i] = NULL;
+        } else {
+            sz = rnd(w) % 8 ? w->sizes[i] + w->sizes[i] / 2 + 1 : w->sizes[i] / 2 + 1;
+            w->slots[i] = timed_realloc(w, w->slots[i], w->sizes[i], sz);
+            w->sizes[i] = sz;
+        }
+    }
+    free_slots(w);
+}
+
+static const struct workload workloads[] = {
+    {"churn", run_churn},
+    {"lifo", run_lifo},
+    {"fifo", run_fifo},
+    {"batch", run_batch},
+    {"scope", run_scope},
+    {"prodcons", run_prodcons},
+    {"larson", run_larson},
+    {"realloc", run_realloc},
+};
+
+static const struct workload *workload;
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    pthread_barrier_wait(&start_barrier);
+    workload->run(w);
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t seen = 0;
+    unsigned int b;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen && seen >= total * p) {
+            return lat_bucket_max(b);
+        }
+    }
+    return 0;
+}
+
+static void usage()
+{
+    size_t i;
+    fprintf(stderr, "usage: bench [-a algo] [-w workload] [-t threads] [-n ops] [-s max size] [-r seed]\nworkloads:");
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    static uint64_t hist[LAT_BUCKETS];
+    const char *algo = NULL;
+    uint64_t seed = 88172645463325252ULL;
+    uint64_t start, elapsed, total = 0;
+    size_t i;
+    int opt, t;
+    workload = &workloads[0];
+    while ((opt = getopt(argc, argv, "a:w:t:n:s:r:")) != -1) {
+        switch (opt) {
+        case 'a':
+            algo = optarg;
+            break;
+        case 'w':
+            for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+                if (!strcmp(workloads[i].name, optarg)) {
+                    break;
+                }
+            }
+            if (i == sizeof(workloads) / sizeof(workloads[0])) {
+                usage();
+            }
+            workload = &workloads[i];
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            nops = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            max_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    /* Has to come before anything that might allocate.
+     */
+    if (algo && malloc_set_algo(algo)) {
+        fprintf(stderr, "bench: can't use algo %s\n", algo);
+        return 2;
+    }
+    if (workload->run == run_prodcons) {
+        nthreads = (nthreads + 1) & ~1;
+    }
+    if (nthreads < 1 || nthreads > BENCH_MAX_THREADS || !max_size || !seed) {
+        usage();
+    }
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&round_barrier, NULL, nthreads);
+    for (t = 0; t < nthreads; t++) {
+        workers[t].id = t;
+        workers[t].rng = seed + t * 0x9e3779b97f4a7c15ULL;
+        workers[t].slots = calloc(BENCH_SLOTS, sizeof(void *));
+        workers[t].sizes = calloc(BENCH_SLOTS, sizeof(size_t));
+        workers[t].live = 0;
+        pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+    }
+    peak_mapped = malloc_mapped_bytes();
+    pthread_barrier_wait(&start_barrier);
+    start = now();
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    elapsed = now() - start;
+    for (t = 0; t < nthreads; t++) {
+        for (i = 0; i < LAT_BUCKETS; i++) {
+            hist[i] += workers[t].hist[i];
+        }
+        total += workers[t].ops;
+    }
+    printf("{\"algo\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"ops\":%llu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.0f,"
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+            "\"peak_mapped\":%ld,\"peak_live\":%ld,\"fragmentation\":%.4f}\n",
+            malloc_algo_name(), workload->name, nthreads, (unsigned long long) total,
+            elapsed / 1e9, total / (elapsed / 1e9),
+            (unsigned long long) percentile(hist, total, 0.5),
+            (unsigned long long) percentile(hist, total, 0.99),
+            (unsigned long long) percentile(hist, total, 0.999),
+            peak_mapped, peak_live,
+            peak_mapped ? 1 - (double) peak_live / peak_mapped : 0);
+    return 0;
+}
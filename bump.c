@@ -0,0 +1,182 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Bump arenas, for memory that all dies at once, like everything a
+ * server allocates for one request. Allocating is a pointer bump in the
+ * current chunk, there's no freeing single objects, and a reset or
+ * destroy gives everything back by walking the chunks. The chunks come
+ * from malloc like anything else, start at the size asked for at create
+ * time and double with every new one up to BUMP_MAX_CHUNK. A reset keeps
+ * them for the arena to bump through again, so an arena that is reset
+ * once per request settles on a few chunks and stops calling malloc at
+ * all.
+ *
+ * An arena belongs to one thread at a time; nothing here locks.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "my_malloc.h"
+
+#define BUMP_ALIGN 16
+#define BUMP_MIN_CHUNK 4096
+#define BUMP_DEFAULT_CHUNK (64 * 1024)
+#define BUMP_MAX_CHUNK (4 * 1024 * 1024)
+#define BUMP_HEADER_SIZE ((sizeof(struct bump_chunk) + BUMP_ALIGN - 1) & ~(size_t) (BUMP_ALIGN - 1))
+#define BUMP_DATA(chunk) ((char *) (chunk) + BUMP_HEADER_SIZE)
+
+struct bump_chunk {
+    struct bump_chunk *next;
+    /* Including the header, which is what it was allocated with.
+     */
+    size_t size;
+};
+
+struct bump_arena {
+    /* Chunks handed out from since the last reset, the one being bumped
+     * through first.
+     */
+    struct bump_chunk *used;
+    /* Chunks from before the last reset.
+     */
+    struct bump_chunk *spare;
+    char *ptr;
+    char *end;
+    /* Size of the next chunk that has to be allocated.
+     */
+    size_t chunk_size;
+};
+
+/* chunk_size of 0 picks the default.
+ */
+struct bump_arena *bump_arena_create(size_t chunk_size)
+{
+    struct bump_arena *a = malloc(sizeof(*a));
+    if (!a) {
+        return NULL;
+    }
+    if (!chunk_size) {
+        chunk_size = BUMP_DEFAULT_CHUNK;
+    } else if (chunk_size < BUMP_MIN_CHUNK) {
+        chunk_size = BUMP_MIN_CHUNK;
+    }
+    a->used = NULL;
+    a->spare = NULL;
+    a->ptr = NULL;
+    a->end = NULL;
+    a->chunk_size = chunk_size < BUMP_MAX_CHUNK ? chunk_size : BUMP_MAX_CHUNK;
+    return a;
+}
+
+/* First spare chunk with room for need bytes, or a new one of size.
+ */
+static struct bump_chunk *get_chunk(struct bump_arena *a, size_t need, size_t size)
+{
+    struct bump_chunk **link;
+    struct bump_chunk *chunk;
+    for (link = &a->spare; (chunk = *link); link = &chunk->next) {
+        if (chunk->size >= need) {
+            *link = chunk->next;
+            return chunk;
+        }
+    }
+    if (!(chunk = malloc(size))) {
+        return NULL;
+    }
+    chunk->size = size;
+    if (size == a->chunk_size && a->chunk_size < BUMP_MAX_CHUNK) {
+        a->chunk_size *= 2;
+    }
+    return chunk;
+}
+
+/* A request too big for the rest of the current chunk. One that would
+ * take a good part of a chunk gets a chunk of its own, put behind the
+ * current one so what's left there isn't wasted.
+ */
+static void *bump_slow(struct bump_arena *a, size_t sz)
+{
+    struct bump_chunk *chunk;
+    if (sz > a->chunk_size / 4) {
+        if (!(chunk = get_chunk(a, BUMP_HEADER_SIZE + sz, BUMP_HEADER_SIZE + sz))) {
+            return NULL;
+        }
+        if (a->used) {
+            chunk->next = a->used->next;
+            a->used->next = chunk;
+        } else {
+            chunk->next = NULL;
+            a->used = chunk;
+        }
+        return BUMP_DATA(chunk);
+    }
+    if (!(chunk = get_chunk(a, BUMP_HEADER_SIZE + sz, a->chunk_size))) {
+        return NULL;
+    }
+    chunk->next = a->used;
+    a->used = chunk;
+    a->ptr = BUMP_DATA(chunk) + sz;
+    a->end = (char *) chunk + chunk->size;
+    return BUMP_DATA(chunk);
+}
+
+/* BUMP_ALIGN aligned, and NULL with errno set if there's no memory.
+ */
+void *bump_arena_alloc(struct bump_arena *a, size_t sz)
+{
+    char *ret;
+    if (sz > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sz = sz ? (sz + BUMP_ALIGN - 1) & ~(size_t) (BUMP_ALIGN - 1) : BUMP_ALIGN;
+    if ((size_t) (a->end - a->ptr) < sz) {
+        return bump_slow(a, sz);
+    }
+    ret = a->ptr;
+    a->ptr += sz;
+    return ret;
+}
+
+/* Everything allocated from the arena is gone. Chunks bigger than
+ * BUMP_MAX_CHUNK were for single big requests and go back to malloc, the
+ * rest are kept.
+ */
+void bump_arena_reset(struct bump_arena *a)
+{
+    struct bump_chunk *chunk;
+    struct bump_chunk *next;
+    for (chunk = a->used; chunk; chunk = next) {
+        next = chunk->next;
+        if (chunk->size > BUMP_MAX_CHUNK) {
+            free_sized(chunk, chunk->size);
+        } else {
+            chunk->next = a->spare;
+            a->spare = chunk;
+        }
+    }
+    a->used = NULL;
+    a->ptr = NULL;
+    a->end = NULL;
+}
+
+void bump_arena_destroy(struct bump_arena *a)
+{
+    struct bump_chunk *chunk;
+    struct bump_chunk *next;
+    if (!a) {
+        return;
+    }
+    bump_arena_reset(a);
+    for (chunk = a->spare; chunk; chunk = next) {
+        next = chunk->next;
+        free_sized(chunk, chunk->size);
+    }
+    free(a);
+}
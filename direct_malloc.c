@@ -0,0 +1,138 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Requests above a threshold don't go near the heap at all: each one gets
+ * a mapping of its own which is handed back to the kernel as soon as it's
+ * freed, so big short-lived buffers can't fragment the regions the algos
+ * carve small objects from.
+ *
+ * Like glibc the threshold starts low and is raised to the size of any
+ * direct block that gets freed, on the theory that a program which frees
+ * a buffer of that size will go on allocating them, and paying for an
+ * mmap/munmap pair every time would be worse than keeping them in the
+ * heap. Setting it through mallopt turns that off.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "heap.h"
+
+#define DIRECT_THRESHOLD_MIN (128 * 1024)
+#define DIRECT_THRESHOLD_MAX (32 * 1024 * 1024)
+
+/* Sits just in front of the pointer we hand out. offset is how far that
+ * pointer is from the start of the mapping, which is only more than the
+ * header when the block had to be aligned.
+ */
+struct direct_chunk {
+    size_t len;
+    size_t offset;
+};
+
+#define DIRECT_CHUNK(ptr) ((struct direct_chunk *) (ptr) - 1)
+
+static size_t direct_threshold = DIRECT_THRESHOLD_MIN;
+static int direct_fixed = 0;
+static size_t direct_mapped = 0;
+
+static size_t page_round(size_t sz)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sz + page - 1) & ~(page - 1);
+}
+
+int direct_wanted(size_t sz)
+{
+    return sz >= __atomic_load_n(&direct_threshold, __ATOMIC_RELAXED);
+}
+
+void direct_set_threshold(size_t threshold)
+{
+    __atomic_store_n(&direct_threshold, threshold, __ATOMIC_RELAXED);
+    __atomic_store_n(&direct_fixed, 1, __ATOMIC_RELAXED);
+}
+
+void *direct_malloc(size_t sz, size_t align)
+{
+    char *map;
+    char *ret;
+    size_t len;
+    if (align < sizeof(struct direct_chunk)) {
+        align = sizeof(struct direct_chunk);
+    }
+    if (sz > SIZE_MAX / 2 - align) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Mappings are page aligned, so only bigger alignments need slop.
+     */
+    len = page_round(sz + sizeof(struct direct_chunk)
+            + (align > sizeof(struct direct_chunk) ? align : 0));
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    ret = (char *) (((uintptr_t) map + sizeof(struct direct_chunk) + align - 1)
+            & ~(uintptr_t) (align - 1));
+    DIRECT_CHUNK(ret)->len = len;
+    DIRECT_CHUNK(ret)->offset = ret - map;
+    __atomic_add_fetch(&direct_mapped, len, __ATOMIC_RELAXED);
+    return ret;
+}
+
+void direct_free(void *ptr)
+{
+    struct direct_chunk *chunk = DIRECT_CHUNK(ptr);
+    size_t len = chunk->len;
+    size_t threshold = __atomic_load_n(&direct_threshold, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&direct_fixed, __ATOMIC_RELAXED)
+            && len - chunk->offset > threshold
+            && len - chunk->offset <= DIRECT_THRESHOLD_MAX) {
+        __atomic_store_n(&direct_threshold, len - chunk->offset, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&direct_mapped, len, __ATOMIC_RELAXED);
+    munmap((char *) ptr - chunk->offset, len);
+}
+
+/* Let the kernel move the pages rather than copying them. Returns NULL
+ * (with ptr untouched) if that isn't possible.
+ */
+void *direct_realloc(void *ptr, size_t sz)
+{
+    struct direct_chunk *chunk = DIRECT_CHUNK(ptr);
+    size_t offset = chunk->offset;
+    char *map = (char *) ptr - offset;
+    size_t len;
+    if (sz > SIZE_MAX / 2) {
+        return NULL;
+    }
+    len = page_round(sz + offset);
+    if (len == chunk->len) {
+        return ptr;
+    }
+    map = mremap(map, chunk->len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_add_fetch(&direct_mapped, len - DIRECT_CHUNK(map + offset)->len, __ATOMIC_RELAXED);
+    DIRECT_CHUNK(map + offset)->len = len;
+    return map + offset;
+}
+
+size_t direct_mapped_bytes()
+{
+    return __atomic_load_n(&direct_mapped, __ATOMIC_RELAXED);
+}
+
+size_t direct_usable_size(void *ptr)
+{
+    return DIRECT_CHUNK(ptr)->len - DIRECT_CHUNK(ptr)->offset;
+}
@@ -7,114 +7,653 @@
  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/* Best-fit allocator with a fat header on every block. Blocks are linked
+ * to their physical neighbours, so a free only ever has to look at the
+ * blocks on either side of it to coalesce. Free blocks are also kept in a
+ * red-black tree ordered by size, then address, whose node lives in the
+ * free buffer; allocation takes the leftmost block that is big enough,
+ * which is the smallest fit and, among equals, the lowest in memory.
+ *
+ * For purging, a free block is marked aged by the first decay pass that
+ * sees it and purged by the next, unless it has been merged in between.
+ */
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "heap.h"
+#include "my_malloc.h"
 
 #define FAT_BLOCK(ptr) ((struct fat_block *) ptr - 1)
+#define FAT_NODE(blk) ((struct fat_node *) (blk)->buffer)
+#define LEFT(blk) FAT_NODE(blk)->left
+#define RIGHT(blk) FAT_NODE(blk)->right
+#define PARENT(blk) FAT_NODE(blk)->parent
+#define FAT_FREE 0x1
+#define FAT_RED 0x2
+#define FAT_AGED 0x4
+#define FAT_PURGED 0x8
+#define FAT_DECAY (FAT_AGED | FAT_PURGED)
+/* Every buffer has to be able to hold a tree node once it's freed.
+ */
+#define FAT_MIN_SIZE 32
+#define FAT_MAX_SIZE (INT_MAX & ~15)
 
 struct fat_block {
+    /* Physical neighbours, NULL at either end of a region.
+     */
     struct fat_block *prev;
     struct fat_block *next;
     int sz;
+    int flags;
     char *buffer;
 };
 
-static struct fat_block *free_list = NULL;
+struct fat_node {
+    struct fat_block *left;
+    struct fat_block *right;
+    struct fat_block *parent;
+};
 
-void fat_init_heap(struct heap_info *info)
+/* Root of each arena's tree.
+ */
+static struct fat_block *free_roots[HEAP_MAX_ARENAS];
+
+static size_t round_size(size_t sz)
 {
-    struct fat_block *tmp = (struct fat_block *) info->heap;
-    tmp->prev = NULL;
-    tmp->next = NULL;
-    tmp->sz = info->size - sizeof(*tmp);
-    tmp->buffer = info->heap + sizeof(*tmp);
-    free_list = tmp;
+    return sz < FAT_MIN_SIZE ? FAT_MIN_SIZE : (sz + 15) & ~(size_t) 15;
 }
 
-void fat_print_free_list()
+static int block_less(struct fat_block *a, struct fat_block *b)
 {
-    struct fat_block *tmp = free_list;
-    printf("----------\n");
-    printf("Free list:\n");
-    printf("----------\n");
-    while (tmp) {
-        printf("addr: %p\n", tmp);
-        printf("size: %d\n", tmp->sz);
-        printf("buffer: %p\n", tmp->buffer);
-        printf("\n");
-        tmp = tmp->next;
+    return a->sz < b->sz || (a->sz == b->sz && a < b);
+}
+
+static int is_red(struct fat_block *blk)
+{
+    return blk && (blk->flags & FAT_RED);
+}
+
+static void set_red(struct fat_block *blk, int red)
+{
+    blk->flags = red ? blk->flags | FAT_RED : blk->flags & ~FAT_RED;
+}
+
+/* Put v where u was under u's parent.
+ */
+static void replace_child(struct fat_block **root, struct fat_block *u, struct fat_block *v)
+{
+    struct fat_block *parent = PARENT(u);
+    if (!parent) {
+        *root = v;
+    } else if (LEFT(parent) == u) {
+        LEFT(parent) = v;
+    } else {
+        RIGHT(parent) = v;
+    }
+    if (v) {
+        PARENT(v) = parent;
+    }
+}
+
+static void rotate_left(struct fat_block **root, struct fat_block *x)
+{
+    struct fat_block *y = RIGHT(x);
+    RIGHT(x) = LEFT(y);
+    if (LEFT(y)) {
+        PARENT(LEFT(y)) = x;
+    }
+    replace_child(root, x, y);
+    LEFT(y) = x;
+    PARENT(x) = y;
+}
+
+static void rotate_right(struct fat_block **root, struct fat_block *x)
+{
+    struct fat_block *y = LEFT(x);
+    LEFT(x) = RIGHT(y);
+    if (RIGHT(y)) {
+        PARENT(RIGHT(y)) = x;
     }
+    replace_child(root, x, y);
+    RIGHT(y) = x;
+    PARENT(x) = y;
 }
 
-void *fat_malloc(size_t sz)
+static void tree_insert(struct fat_block **root, struct fat_block *blk)
 {
-    struct fat_block *tmp = free_list;
-    struct fat_block *next = NULL;
-    if (sz % 8)
-        sz = sz - (sz % 8) + 8;
+    struct fat_block *parent = NULL;
+    struct fat_block *tmp = *root;
+    struct fat_block *grand;
+    struct fat_block *uncle;
     while (tmp) {
-        if (tmp->sz > sz) {
-            next = tmp->next;
-            if (tmp->sz > sz + sizeof(*next)) {
-                next = (struct fat_block *) (tmp->buffer + sz);
-                next->prev = tmp->prev;
-                next->next = tmp->next;
-                next->sz = tmp->sz - sz - sizeof(*next);
-                next->buffer = (char *)(next + 1);
+        parent = tmp;
+        tmp = block_less(blk, tmp) ? LEFT(tmp) : RIGHT(tmp);
+    }
+    LEFT(blk) = NULL;
+    RIGHT(blk) = NULL;
+    PARENT(blk) = parent;
+    if (!parent) {
+        *root = blk;
+    } else if (block_less(blk, parent)) {
+        LEFT(parent) = blk;
+    } else {
+        RIGHT(parent) = blk;
+    }
+    blk->flags |= FAT_FREE | FAT_RED;
+    while (is_red(parent = PARENT(blk))) {
+        grand = PARENT(parent);
+        if (parent == LEFT(grand)) {
+            uncle = RIGHT(grand);
+            if (is_red(uncle)) {
+                set_red(parent, 0);
+                set_red(uncle, 0);
+                set_red(grand, 1);
+                blk = grand;
+                continue;
             }
-            if (tmp->prev) {
-                tmp->prev->next = next;
+            if (blk == RIGHT(parent)) {
+                rotate_left(root, parent);
+                blk = parent;
+                parent = PARENT(blk);
             }
-            if (tmp->next) {
-                tmp->next->prev = next;
+            set_red(parent, 0);
+            set_red(grand, 1);
+            rotate_right(root, grand);
+        } else {
+            uncle = LEFT(grand);
+            if (is_red(uncle)) {
+                set_red(parent, 0);
+                set_red(uncle, 0);
+                set_red(grand, 1);
+                blk = grand;
+                continue;
             }
-            if (free_list == tmp) {
-                free_list = next;
+            if (blk == LEFT(parent)) {
+                rotate_right(root, parent);
+                blk = parent;
+                parent = PARENT(blk);
             }
-            tmp->sz = sz;
-            return tmp->buffer;
+            set_red(parent, 0);
+            set_red(grand, 1);
+            rotate_left(root, grand);
         }
-        tmp = tmp->next;
-    };
-    return NULL;
+    }
+    set_red(*root, 0);
 }
 
-void fat_coalesce_free_list()
+/* x has an extra black, and may be NULL, hence its parent being passed
+ * along.
+ */
+static void remove_fixup(struct fat_block **root, struct fat_block *x, struct fat_block *parent)
 {
-    struct fat_block *tmp = free_list;
-    while (tmp->next) {
-        if ((struct fat_block *) (tmp->buffer + tmp->sz) == tmp->next) {
-            tmp->sz += tmp->next->sz + sizeof(*tmp->next);
-            tmp->next = tmp->next->next;
-            if (tmp->next) {
-                tmp->next->prev = tmp;
+    struct fat_block *sib;
+    while (x != *root && !is_red(x)) {
+        if (x == LEFT(parent)) {
+            sib = RIGHT(parent);
+            if (is_red(sib)) {
+                set_red(sib, 0);
+                set_red(parent, 1);
+                rotate_left(root, parent);
+                sib = RIGHT(parent);
+            }
+            if (!is_red(LEFT(sib)) && !is_red(RIGHT(sib))) {
+                set_red(sib, 1);
+                x = parent;
+                parent = PARENT(x);
+                continue;
+            }
+            if (!is_red(RIGHT(sib))) {
+                set_red(LEFT(sib), 0);
+                set_red(sib, 1);
+                rotate_right(root, sib);
+                sib = RIGHT(parent);
             }
+            set_red(sib, is_red(parent));
+            set_red(parent, 0);
+            set_red(RIGHT(sib), 0);
+            rotate_left(root, parent);
         } else {
-            tmp = tmp->next;
+            sib = LEFT(parent);
+            if (is_red(sib)) {
+                set_red(sib, 0);
+                set_red(parent, 1);
+                rotate_right(root, parent);
+                sib = LEFT(parent);
+            }
+            if (!is_red(LEFT(sib)) && !is_red(RIGHT(sib))) {
+                set_red(sib, 1);
+                x = parent;
+                parent = PARENT(x);
+                continue;
+            }
+            if (!is_red(LEFT(sib))) {
+                set_red(RIGHT(sib), 0);
+                set_red(sib, 1);
+                rotate_left(root, sib);
+                sib = LEFT(parent);
+            }
+            set_red(sib, is_red(parent));
+            set_red(parent, 0);
+            set_red(LEFT(sib), 0);
+            rotate_right(root, parent);
         }
+        x = *root;
+    }
+    if (x) {
+        set_red(x, 0);
     }
 }
 
-void fat_free(void *ptr)
+static void tree_remove(struct fat_block **root, struct fat_block *blk)
 {
-    struct fat_block *tmp = free_list;
-    while (tmp && (void *) tmp < ptr) {
-        tmp = tmp->next;
-    }
-    FAT_BLOCK(ptr)->next = tmp;
-    FAT_BLOCK(ptr)->prev = tmp->prev;
-    if (tmp->prev) {
-        tmp->prev->next = FAT_BLOCK(ptr);
+    struct fat_block *succ = blk;
+    struct fat_block *x;
+    struct fat_block *parent;
+    int removed_red = is_red(blk);
+    if (!LEFT(blk)) {
+        x = RIGHT(blk);
+        parent = PARENT(blk);
+        replace_child(root, blk, x);
+    } else if (!RIGHT(blk)) {
+        x = LEFT(blk);
+        parent = PARENT(blk);
+        replace_child(root, blk, x);
     } else {
-        free_list = FAT_BLOCK(ptr);
+        /* Swap in the successor, which has no left child.
+         */
+        succ = RIGHT(blk);
+        while (LEFT(succ)) {
+            succ = LEFT(succ);
+        }
+        removed_red = is_red(succ);
+        x = RIGHT(succ);
+        if (PARENT(succ) == blk) {
+            parent = succ;
+        } else {
+            parent = PARENT(succ);
+            replace_child(root, succ, x);
+            RIGHT(succ) = RIGHT(blk);
+            PARENT(RIGHT(succ)) = succ;
+        }
+        replace_child(root, blk, succ);
+        LEFT(succ) = LEFT(blk);
+        PARENT(LEFT(succ)) = succ;
+        set_red(succ, is_red(blk));
+    }
+    if (!removed_red) {
+        remove_fixup(root, x, parent);
+    }
+    blk->flags &= ~(FAT_FREE | FAT_RED);
+}
+
+/* Smallest free block of at least sz bytes.
+ */
+static struct fat_block *best_fit(struct fat_block *root, size_t sz)
+{
+    struct fat_block *tmp = root;
+    struct fat_block *best = NULL;
+    while (tmp) {
+        if ((size_t) tmp->sz >= sz) {
+            best = tmp;
+            tmp = LEFT(tmp);
+        } else {
+            tmp = RIGHT(tmp);
+        }
+    }
+    return best;
+}
+
+static struct fat_block *largest(struct fat_block *root)
+{
+    struct fat_block *tmp = root;
+    while (tmp && RIGHT(tmp)) {
+        tmp = RIGHT(tmp);
+    }
+    return tmp;
+}
+
+/* Fold next, which must follow blk in memory, into blk.
+ */
+static void absorb(struct fat_block *blk, struct fat_block *next)
+{
+    blk->sz += sizeof(*next) + next->sz;
+    blk->next = next->next;
+    if (blk->next) {
+        blk->next->prev = blk;
+    }
+}
+
+/* Cut blk, which isn't in the tree, down to sz bytes. Returns the rest as
+ * a new block (not in the tree either), NULL if there wasn't enough left
+ * over to make one.
+ */
+static struct fat_block *split(struct fat_block *blk, size_t sz)
+{
+    struct fat_block *rest;
+    if ((size_t) blk->sz < sz + sizeof(*rest) + FAT_MIN_SIZE) {
+        return NULL;
+    }
+    rest = (struct fat_block *) (blk->buffer + sz);
+    rest->prev = blk;
+    rest->next = blk->next;
+    if (rest->next) {
+        rest->next->prev = rest;
+    }
+    rest->sz = blk->sz - sz - sizeof(*rest);
+    rest->flags = 0;
+    rest->buffer = (char *) (rest + 1);
+    blk->next = rest;
+    blk->sz = sz;
+    return rest;
+}
+
+/* One block's part in a purge, see struct alloc_algo. The tree node at
+ * the front of the buffer stays.
+ */
+static size_t purge_block(struct fat_block *blk, int all)
+{
+    size_t ret;
+    if (blk->flags & FAT_PURGED) {
+        return 0;
+    }
+    if (!all && !(blk->flags & FAT_AGED)) {
+        blk->flags |= FAT_AGED;
+        return 0;
+    }
+    ret = heap_purge_span(blk->buffer + sizeof(struct fat_node), blk->buffer + blk->sz,
+            all ? 0 : HEAP_PURGE_MIN);
+    if (ret) {
+        blk->flags |= FAT_PURGED;
+    }
+    return ret;
+}
+
+static void print_tree(struct fat_block *tmp)
+{
+    if (!tmp) {
+        return;
+    }
+    print_tree(LEFT(tmp));
+    printf("addr: %p\n", tmp);
+    printf("size: %d\n", tmp->sz);
+    printf("buffer: %p\n", tmp->buffer);
+    printf("\n");
+    print_tree(RIGHT(tmp));
+}
+
+void fat_print_free_list(struct heap_info *info)
+{
+    printf("----------\n");
+    printf("Free list:\n");
+    printf("----------\n");
+    print_tree(free_roots[info->arena]);
+}
+
+void *fat_malloc(struct heap_info *info, size_t sz)
+{
+    struct fat_block **root = &free_roots[info->arena];
+    struct fat_block *blk;
+    struct fat_block *rest;
+    if (sz > FAT_MAX_SIZE) {
+        return NULL;
     }
-    tmp->prev = FAT_BLOCK(ptr);
-    fat_coalesce_free_list();
+    sz = round_size(sz);
+    blk = best_fit(*root, sz);
+    if (!blk) {
+        return NULL;
+    }
+    tree_remove(root, blk);
+    /* blk was free, so neither of its neighbours is. What is left of it
+     * has been free as long as it has.
+     */
+    rest = split(blk, sz);
+    if (rest) {
+        rest->flags = blk->flags & FAT_DECAY;
+        tree_insert(root, rest);
+    }
+    blk->flags &= ~FAT_DECAY;
+    return blk->buffer;
+}
+
+void fat_free(struct heap_info *info, void *ptr)
+{
+    struct fat_block **root = &free_roots[info->arena];
+    struct fat_block *blk = FAT_BLOCK(ptr);
+    /* Aged neighbours are purged as they merge, see purge in heap.h.
+     */
+    if (blk->next && (blk->next->flags & FAT_FREE)) {
+        tree_remove(root, blk->next);
+        purge_block(blk->next, 0);
+        absorb(blk, blk->next);
+    }
+    if (blk->prev && (blk->prev->flags & FAT_FREE)) {
+        tree_remove(root, blk->prev);
+        purge_block(blk->prev, 0);
+        absorb(blk->prev, blk);
+        blk = blk->prev;
+    }
+    blk->flags &= ~FAT_DECAY;
+    tree_insert(root, blk);
+}
+
+/* Blocks are cut one after another off a single free block that can
+ * hold the rest of the batch, or failing that off the biggest there is,
+ * so the tree only changes once per block used rather than once per
+ * allocation.
+ */
+size_t fat_malloc_batch(struct heap_info *info, size_t sz, size_t n, void **ptrs)
+{
+    struct fat_block **root = &free_roots[info->arena];
+    struct fat_block *blk;
+    struct fat_block *rest;
+    size_t step;
+    size_t got = 0;
+    int flags;
+    if (sz > FAT_MAX_SIZE) {
+        return 0;
+    }
+    sz = round_size(sz);
+    step = sz + sizeof(*blk);
+    while (got < n) {
+        blk = NULL;
+        if (n - got <= (FAT_MAX_SIZE + sizeof(*blk)) / step) {
+            blk = best_fit(*root, (n - got) * step - sizeof(*blk));
+        }
+        if (!blk && (!(blk = largest(*root)) || (size_t) blk->sz < sz)) {
+            break;
+        }
+        tree_remove(root, blk);
+        flags = blk->flags & FAT_DECAY;
+        for (;;) {
+            rest = split(blk, sz);
+            blk->flags &= ~FAT_DECAY;
+            ptrs[got++] = blk->buffer;
+            if (!rest) {
+                break;
+            }
+            if (got == n || (size_t) rest->sz < sz) {
+                rest->flags = flags;
+                tree_insert(root, rest);
+                break;
+            }
+            blk = rest;
+        }
+    }
+    return got;
+}
+
+/* Each run of blocks that sit next to each other is folded into one
+ * block first, which then goes back with a single fat_free.
+ */
+void fat_free_batch(struct heap_info *info, size_t n, void **ptrs)
+{
+    struct fat_block *blk;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        blk = FAT_BLOCK(ptrs[i]);
+        while (i + 1 < n && blk->next == FAT_BLOCK(ptrs[i + 1])) {
+            absorb(blk, blk->next);
+            i++;
+        }
+        fat_free(info, blk->buffer);
+    }
+}
+
+int fat_add_region(struct heap_info *info, char *base, size_t size)
+{
+    struct fat_block **root = &free_roots[info->arena];
+    struct fat_block *blk = (struct fat_block *) base;
+    if (size - sizeof(*blk) > FAT_MAX_SIZE) {
+        return -1;
+    }
+    blk->prev = NULL;
+    blk->next = NULL;
+    blk->sz = size - sizeof(*blk);
+    blk->flags = 0;
+    blk->buffer = base + sizeof(*blk);
+    tree_insert(root, blk);
+    return 0;
+}
+
+void fat_init_heap(struct heap_info *info)
+{
+    free_roots[info->arena] = NULL;
+    fat_add_region(info, info->heap, info->size);
+}
+
+/* Give back whatever blk has past sz bytes, if there's enough of it to
+ * make a block out of.
+ */
+static void fat_trim(struct heap_info *info, struct fat_block *blk, size_t sz)
+{
+    struct fat_block *rest = split(blk, sz);
+    if (rest) {
+        fat_free(info, rest->buffer);
+    }
+}
+
+int fat_resize(struct heap_info *info, void *ptr, size_t sz)
+{
+    struct fat_block **root = &free_roots[info->arena];
+    struct fat_block *blk = FAT_BLOCK(ptr);
+    struct fat_block *next = blk->next;
+    if (sz > FAT_MAX_SIZE) {
+        return 0;
+    }
+    sz = round_size(sz);
+    if (sz > (size_t) blk->sz) {
+        /* The only way to grow is to swallow the free block right after
+         * this one.
+         */
+        if (!next || !(next->flags & FAT_FREE)
+                || blk->sz + sizeof(*next) + next->sz < sz) {
+            return 0;
+        }
+        tree_remove(root, next);
+        absorb(blk, next);
+    }
+    fat_trim(info, blk, sz);
+    return 1;
+}
+
+void *fat_memalign(struct heap_info *info, size_t align, size_t sz)
+{
+    char *ptr;
+    char *aligned;
+    struct fat_block *lead;
+    struct fat_block *blk;
+    if (align <= 16) {
+        return fat_malloc(info, sz);
+    }
+    if (sz > FAT_MAX_SIZE || align > FAT_MAX_SIZE / 4) {
+        return NULL;
+    }
+    sz = round_size(sz);
+    ptr = fat_malloc(info, sz + 2 * align + sizeof(*blk) + FAT_MIN_SIZE);
+    if (!ptr) {
+        return NULL;
+    }
+    aligned = (char *) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+    if (aligned != ptr) {
+        /* Split the slop in front off into its own free block, which
+         * needs room for a header and a tree node.
+         */
+        while ((size_t) (aligned - ptr) < sizeof(*blk) + FAT_MIN_SIZE) {
+            aligned += align;
+        }
+        lead = FAT_BLOCK(ptr);
+        blk = FAT_BLOCK(aligned);
+        blk->sz = lead->sz - (aligned - ptr);
+        blk->flags = 0;
+        blk->buffer = aligned;
+        blk->prev = lead;
+        blk->next = lead->next;
+        if (blk->next) {
+            blk->next->prev = blk;
+        }
+        lead->next = blk;
+        lead->sz = aligned - ptr - sizeof(*blk);
+        fat_free(info, ptr);
+    }
+    fat_trim(info, FAT_BLOCK(aligned), sz);
+    return aligned;
+}
+
+size_t fat_usable_size(void *ptr)
+{
+    return FAT_BLOCK(ptr)->sz;
+}
+
+static size_t purge_tree(struct fat_block *tmp, int all)
+{
+    if (!tmp) {
+        return 0;
+    }
+    return purge_tree(LEFT(tmp), all) + purge_block(tmp, all) + purge_tree(RIGHT(tmp), all);
+}
+
+size_t fat_purge(struct heap_info *info, int all)
+{
+    return purge_tree(free_roots[info->arena], all);
+}
+
+#ifdef MALLOC_STATS
+static void tree_stats(struct fat_block *tmp, struct malloc_stats *st)
+{
+    if (!tmp) {
+        return;
+    }
+    tree_stats(LEFT(tmp), st);
+    st->free_bytes += tmp->sz;
+    st->free_blocks++;
+    if ((size_t) tmp->sz > st->largest_free) {
+        st->largest_free = tmp->sz;
+    }
+    tree_stats(RIGHT(tmp), st);
+}
+
+void fat_stats(struct heap_info *info, struct malloc_stats *st)
+{
+    tree_stats(free_roots[info->arena], st);
 }
+#endif
 
 struct alloc_algo fat_algo = {
+    .id = ALGO_FAT,
+    .fresh_zero = 1,
+    .link_size = sizeof(struct fat_node),
     .init = fat_init_heap,
     .malloc = fat_malloc,
     .free = fat_free,
+    .usable_size = fat_usable_size,
+    .resize = fat_resize,
+    .memalign = fat_memalign,
+    .malloc_batch = fat_malloc_batch,
+    .free_batch = fat_free_batch,
+    .add_region = fat_add_region,
     .print_free_list = fat_print_free_list,
+    .purge = fat_purge,
+#ifdef MALLOC_STATS
+    .stats = fat_stats,
+#endif
 };
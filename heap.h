@@ -9,20 +9,300 @@
 
 #ifndef _HEAP_H
 #define _HEAP_H
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/* Regions are mapped on HEAP_ALIGN boundaries, see region.c.
+ */
+#define HEAP_ALIGN_SHIFT 20
+#define HEAP_ALIGN ((size_t) 1 << HEAP_ALIGN_SHIFT)
+
+/* With huge pages, regions are whole huge pages instead, see
+ * heap_set_huge.
+ */
+#define HEAP_HUGE_SHIFT 21
+#define HEAP_HUGE_SIZE ((size_t) 1 << HEAP_HUGE_SHIFT)
+
+/* Most arenas there can be. In header-less mode each one has a
+ * small-object arena alongside it, HEAP_MAX_ARENAS further on in the
+ * table, see my_malloc.c. The region map keeps the arena that owns each
+ * HEAP_ALIGN chunk in a byte, so HEAP_ARENA_SLOTS can't go past 255.
+ */
+#define HEAP_MAX_ARENAS 64
+#define HEAP_ARENA_SLOTS (2 * HEAP_MAX_ARENAS)
+
+/* Largest request the small-object arenas take.
+ */
+#define HEAP_SMALL_MAX 256
+
+/* Smallest span of free pages a decay pass bothers to give back, see
+ * heap_decay in my_malloc.c.
+ */
+#define HEAP_PURGE_MIN (64 * 1024)
+
 struct heap_info;
+struct malloc_stats;
+
+enum heap_huge {
+    HEAP_HUGE_NONE,
+    /* Transparent huge pages, asked for with madvise.
+     */
+    HEAP_HUGE_THP,
+    /* MAP_HUGETLB, falling back to THP once the reserved pages run out.
+     */
+    HEAP_HUGE_TLB,
+};
+
+/* Which backend a struct alloc_algo is. The hot paths switch on this and
+ * call the backend directly (see algo_malloc and friends below) instead of
+ * going through the function pointers, which are left for the cold ones.
+ */
+enum algo_id {
+    ALGO_FAT,
+    ALGO_THIN,
+    ALGO_TREE,
+    ALGO_SLAB,
+};
 
 struct alloc_algo {
+    enum algo_id id;
+    /* Set if the algo does its own locking, so it can be called without
+     * the arena lock. Growing the heap still takes it.
+     */
+    char concurrent;
+    /* Set if a buffer carved from a region mapped just for it is known to
+     * be zero past its first link_size bytes, where the algo may have kept
+     * the free structure it was carved from; calloc then only clears
+     * those. Left unset for concurrent algos, since other threads can
+     * have used and freed the new region before the buffer came out of
+     * it.
+     */
+    char fresh_zero;
+    size_t link_size;
+    /* Everything but usable_size works on the free structures of one
+     * arena, which backends keep per info->arena.
+     */
     void (*init)(struct heap_info *info);
-    void *(*malloc)(size_t sz);
-    void (*free)(void *ptr);
-    void (*print_free_list)();
+    void *(*malloc)(struct heap_info *info, size_t sz);
+    void (*free)(struct heap_info *info, void *ptr);
+    size_t (*usable_size)(void *ptr);
+    /* Grow or shrink an allocation without moving it. Returns nonzero if
+     * that worked.
+     */
+    int (*resize)(struct heap_info *info, void *ptr, size_t sz);
+    void *(*memalign)(struct heap_info *info, size_t align, size_t sz);
+    /* Fill ptrs with up to n blocks of sz bytes in one pass over the free
+     * structures. Returns how many it got.
+     */
+    size_t (*malloc_batch)(struct heap_info *info, size_t sz, size_t n, void **ptrs);
+    /* Free n blocks, sorted by address, so ones that sit next to each
+     * other can be merged before they go back.
+     */
+    void (*free_batch)(struct heap_info *info, size_t n, void **ptrs);
+    /* Hand a newly mapped region to the algo. Returns nonzero if the
+     * algo can't use it.
+     */
+    int (*add_region)(struct heap_info *info, char *base, size_t size);
+    void (*print_free_list)(struct heap_info *info);
+    /* Give the whole pages inside free blocks back to the OS. A decay
+     * pass (all == 0) only takes blocks of HEAP_PURGE_MIN or more that
+     * have stayed free since the last pass, and marks the rest for the
+     * next one; with all set every free page goes. Returns the bytes
+     * given back. Called with the arena lock held.
+     *
+     * A block made by merging free ones starts out young, which would
+     * keep the pages of an aged neighbour for two more passes, so free
+     * gives each aged neighbour the purge it was due as it merges it.
+     */
+    size_t (*purge)(struct heap_info *info, int all);
+#ifdef MALLOC_STATS
+    /* Add the free space of the arena to st. Called with its lock held.
+     */
+    void (*stats)(struct heap_info *info, struct malloc_stats *st);
+#endif
 };
 
+/* One arena: a set of regions with the backend's free structures over
+ * them and the lock guarding both. Each thread allocates from the arena
+ * it was given, see my_malloc.c.
+ */
 struct heap_info {
+    /* The first region, the one passed to init.
+     */
     char *heap;
     size_t size;
+    /* Bytes mapped over all regions, and the size of the next one.
+     */
+    size_t mapped;
+    size_t grow_size;
     struct alloc_algo *algo;
+    enum algo_id algo_id;
+    pthread_mutex_t lock;
+    /* Index into the arena table, which backends key their state by.
+     */
+    unsigned int arena;
+    char concurrent;
     char initialized;
+    /* When the next decay pass is due, in milliseconds.
+     */
+    uint64_t decay_at;
+    /* Blocks freed by threads of other arenas, pushed here without the
+     * lock and linked through their first word. Drained under the lock.
+     * Other threads write it all the time, so it gets a cache line of
+     * its own.
+     */
+    void *remote __attribute__((aligned(64)));
 };
+
+void *fat_malloc(struct heap_info *info, size_t sz);
+void fat_free(struct heap_info *info, void *ptr);
+size_t fat_usable_size(void *ptr);
+int fat_resize(struct heap_info *info, void *ptr, size_t sz);
+void *fat_memalign(struct heap_info *info, size_t align, size_t sz);
+void *thin_malloc(struct heap_info *info, size_t sz);
+void thin_free(struct heap_info *info, void *ptr);
+size_t thin_usable_size(void *ptr);
+int thin_resize(struct heap_info *info, void *ptr, size_t sz);
+void *thin_memalign(struct heap_info *info, size_t align, size_t sz);
+void *tree_alloc(struct heap_info *info, size_t size);
+void tree_free(struct heap_info *info, void *ptr);
+size_t tree_usable_size(void *ptr);
+int tree_resize(struct heap_info *info, void *ptr, size_t size);
+void *tree_memalign(struct heap_info *info, size_t align, size_t size);
+int tree_region_format(char *base, size_t size);
+int tree_region_attach(char *base, size_t size);
+void tree_region_rebuild(char *base);
+void *tree_region_alloc(char *base, size_t size);
+void tree_region_free(char *base, void *ptr);
+size_t tree_region_usable_size(char *base, void *ptr);
+void *slab_malloc(struct heap_info *info, size_t sz);
+void slab_free(struct heap_info *info, void *ptr);
+size_t slab_usable_size(void *ptr);
+int slab_resize(struct heap_info *info, void *ptr, size_t sz);
+void *slab_memalign(struct heap_info *info, size_t align, size_t sz);
+
+static inline void *algo_malloc(struct heap_info *info, size_t sz)
+{
+    switch (info->algo_id) {
+    case ALGO_FAT:
+        return fat_malloc(info, sz);
+    case ALGO_THIN:
+        return thin_malloc(info, sz);
+    case ALGO_TREE:
+        return tree_alloc(info, sz);
+    default:
+        return slab_malloc(info, sz);
+    }
+}
+
+static inline void algo_free(struct heap_info *info, void *ptr)
+{
+    switch (info->algo_id) {
+    case ALGO_FAT:
+        fat_free(info, ptr);
+        break;
+    case ALGO_THIN:
+        thin_free(info, ptr);
+        break;
+    case ALGO_TREE:
+        tree_free(info, ptr);
+        break;
+    default:
+        slab_free(info, ptr);
+    }
+}
+
+static inline size_t algo_usable_size(struct heap_info *info, void *ptr)
+{
+    switch (info->algo_id) {
+    case ALGO_FAT:
+        return fat_usable_size(ptr);
+    case ALGO_THIN:
+        return thin_usable_size(ptr);
+    case ALGO_TREE:
+        return tree_usable_size(ptr);
+    default:
+        return slab_usable_size(ptr);
+    }
+}
+
+static inline int algo_resize(struct heap_info *info, void *ptr, size_t sz)
+{
+    switch (info->algo_id) {
+    case ALGO_FAT:
+        return fat_resize(info, ptr, sz);
+    case ALGO_THIN:
+        return thin_resize(info, ptr, sz);
+    case ALGO_TREE:
+        return tree_resize(info, ptr, sz);
+    default:
+        return slab_resize(info, ptr, sz);
+    }
+}
+
+static inline void *algo_memalign(struct heap_info *info, size_t align, size_t sz)
+{
+    switch (info->algo_id) {
+    case ALGO_FAT:
+        return fat_memalign(info, align, sz);
+    case ALGO_THIN:
+        return thin_memalign(info, align, sz);
+    case ALGO_TREE:
+        return tree_memalign(info, align, sz);
+    default:
+        return slab_memalign(info, align, sz);
+    }
+}
+
+/* Around calls into the algo, for algos that need it.
+ */
+static inline void arena_lock(struct heap_info *info)
+{
+    if (!info->concurrent) {
+        pthread_mutex_lock(&info->lock);
+    }
+}
+
+static inline void arena_unlock(struct heap_info *info)
+{
+    if (!info->concurrent) {
+        pthread_mutex_unlock(&info->lock);
+    }
+}
+
+struct heap_info *heap_get_arena(unsigned int i);
+struct heap_info *heap_owner(void *ptr);
+char *heap_map_region(struct heap_info *info, size_t size);
+void heap_unmap_region(char *base, size_t size);
+size_t heap_purge_span(char *start, char *end, size_t min);
+void heap_set_huge(enum heap_huge mode);
+int heap_owns(void *ptr);
+char *heap_region_of(void *ptr);
+void *heap_alloc(struct heap_info *info, size_t sz, int *fresh);
+void heap_remote_free(struct heap_info *info, void *first, void *last);
+void heap_decay(struct heap_info *info);
+
+int direct_wanted(size_t sz);
+void direct_set_threshold(size_t threshold);
+void *direct_malloc(size_t sz, size_t align);
+void direct_free(void *ptr);
+void *direct_realloc(void *ptr, size_t sz);
+size_t direct_usable_size(void *ptr);
+size_t direct_mapped_bytes();
+
+void *tcache_malloc(struct heap_info *info, size_t sz, int *fresh);
+void tcache_free(struct heap_info *info, void *ptr);
+void tcache_free_sized(struct heap_info *info, void *ptr, size_t sz);
+void tcache_disable();
+
+#ifdef MALLOC_STATS
+void stats_alloc(size_t request, size_t usable);
+void stats_free(size_t usable);
+#define STATS_ALLOC(sz, ptr) stats_alloc(sz, malloc_usable_size(ptr))
+#define STATS_FREE(ptr) stats_free(malloc_usable_size(ptr))
+#else
+#define STATS_ALLOC(sz, ptr) ((void) 0)
+#define STATS_FREE(ptr) ((void) 0)
+#endif
 #endif
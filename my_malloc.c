@@ -7,74 +7,975 @@
  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "heap.h"
+#include "my_malloc.h"
+#include "profile.h"
+#include "trace.h"
 
 #define HEAP_SIZE (1024 * 1024)
-
-char heap[HEAP_SIZE] = {0};
+#define HEAP_MAX_GROW (256 * 1024 * 1024)
+/* Room left over in a new region for whatever headers the algo puts
+ * around the request that made us grow.
+ */
+#define HEAP_GROW_SLACK 4096
+#define HEAP_DECAY_MS 10000
+/* Highest mmap threshold that can be set, like glibc. Anything bigger
+ * stays out of the backends.
+ */
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
 
 extern struct alloc_algo fat_algo;
 extern struct alloc_algo thin_algo;
 extern struct alloc_algo tree_algo;
+extern struct alloc_algo ctree_algo;
+extern struct alloc_algo slab_algo;
+extern struct alloc_algo tlsf_algo;
 
-static struct heap_info _info = {
-    .heap = heap,
-    .size = HEAP_SIZE,
-#ifdef USE_TREE_MALLOC
-    .algo = &tree_algo,
+/* Threads are dealt out over arena_count arenas round robin the first
+ * time they allocate, and an arena is only set up once a thread is given
+ * it. Blocks always go back to the arena they came from: a thread freeing
+ * into someone else's arena pushes the block onto that arena's remote
+ * free stack instead of taking its lock, and whoever next allocates from
+ * the arena frees the lot.
+ *
+ * In header-less mode requests of up to HEAP_SMALL_MAX bytes go to a
+ * slab arena paired with the thread's arena instead, whatever the algo,
+ * so small objects carry no header of their own. Those arenas sit
+ * HEAP_MAX_ARENAS on in the table and are otherwise like any other.
+ */
+static struct heap_info arenas[HEAP_ARENA_SLOTS];
+static __thread struct heap_info *_arena;
+static __thread struct heap_info *_small;
+static int headerless = 0;
+static unsigned int arena_count = 1;
+static unsigned int arena_next = 0;
+
+/* What every arena starts out with, settled by init_heap.
+ */
+static size_t heap_size = HEAP_SIZE;
+static long decay_ms = HEAP_DECAY_MS;
+#if defined(USE_TREE_MALLOC)
+static struct alloc_algo *heap_algo = &tree_algo;
+#elif defined(USE_SLAB_MALLOC)
+static struct alloc_algo *heap_algo = &slab_algo;
+#elif defined(USE_TLSF_MALLOC)
+static struct alloc_algo *heap_algo = &tlsf_algo;
 #else
-    .algo = &thin_algo,
+static struct alloc_algo *heap_algo = &thin_algo;
 #endif
-    .initialized = 0,
+
+/* Guards the settings above and setting up arenas.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int heap_initialized = 0;
+
+static const struct {
+    const char *name;
+    struct alloc_algo *algo;
+} algos[] = {
+    {"fat", &fat_algo},
+    {"thin", &thin_algo},
+    {"tlsf", &tlsf_algo},
+    {"tree", &tree_algo},
+    {"ctree", &ctree_algo},
+    {"slab", &slab_algo},
 };
 
-void init_heap()
+/* Set once the program has picked an algo itself, which then wins over
+ * MYMALLOC_BACKEND.
+ */
+static int algo_chosen = 0;
+
+/* Must be called with heap_lock held.
+ */
+static int set_algo(const char *name)
+{
+    size_t i;
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        if (!strcmp(algos[i].name, name)) {
+            heap_algo = algos[i].algo;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int malloc_set_algo(const char *name)
+{
+    int ret = -1;
+    pthread_mutex_lock(&heap_lock);
+    if (!heap_initialized && !set_algo(name)) {
+        algo_chosen = 1;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return ret;
+}
+
+const char *malloc_algo_name()
+{
+    size_t i;
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        if (algos[i].algo == heap_algo) {
+            return algos[i].name;
+        }
+    }
+    return NULL;
+}
+
+size_t malloc_mapped_bytes()
+{
+    size_t mapped = direct_mapped_bytes();
+    unsigned int i;
+    for (i = 0; i < HEAP_ARENA_SLOTS; i++) {
+        mapped += __atomic_load_n(&arenas[i].mapped, __ATOMIC_RELAXED);
+    }
+    return mapped;
+}
+
+/* Startup configuration, mostly for when we're preloaded into a program
+ * that knows nothing about us:
+ *
+ *     MYMALLOC_BACKEND         fat, thin, tlsf, tree, ctree or slab
+ *     MYMALLOC_HEAP_SIZE       size of the first region, rounded up to a
+ *                              power of two of at least HEAP_SIZE
+ *     MYMALLOC_MMAP_THRESHOLD  like mallopt(M_MMAP_THRESHOLD, ...)
+ *     MYMALLOC_TCACHE          0 turns the per-thread caches off
+ *     MYMALLOC_ARENAS          how many arenas to spread threads over,
+ *                              the number of CPUs by default
+ *     MYMALLOC_DECAY_MS        how long free pages stay before going back
+ *                              to the OS, see heap_decay; -1 keeps them
+ *     MYMALLOC_HUGEPAGES       thp to build the heap from 2 MiB regions
+ *                              backed by transparent huge pages, hugetlb
+ *                              to take reserved huge pages first
+ *     MYMALLOC_HEADERLESS      1 to serve small requests from header-less
+ *                              slab pages, see arenas above
+ *
+ * Runs with heap_lock held, and can't allocate.
+ */
+static void read_env()
+{
+    const char *val;
+    size_t size;
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!algo_chosen && (val = getenv("MYMALLOC_BACKEND")) && *val) {
+        set_algo(val);
+    }
+    if ((val = getenv("MYMALLOC_HEAP_SIZE")) && *val) {
+        size = strtoull(val, NULL, 0);
+        while (heap_size < size && heap_size < HEAP_MAX_GROW) {
+            heap_size <<= 1;
+        }
+    }
+    if ((val = getenv("MYMALLOC_MMAP_THRESHOLD")) && *val) {
+        size = strtoull(val, NULL, 0);
+        direct_set_threshold(size < MMAP_THRESHOLD_MAX ? size : MMAP_THRESHOLD_MAX);
+    }
+    if ((val = getenv("MYMALLOC_TCACHE")) && !strcmp(val, "0")) {
+        tcache_disable();
+    }
+    if ((val = getenv("MYMALLOC_ARENAS")) && *val) {
+        count = strtol(val, NULL, 0);
+    }
+    if ((val = getenv("MYMALLOC_DECAY_MS")) && *val) {
+        decay_ms = strtol(val, NULL, 0);
+    }
+    if ((val = getenv("MYMALLOC_HUGEPAGES")) && (!strcmp(val, "thp") || !strcmp(val, "hugetlb"))) {
+        heap_set_huge(!strcmp(val, "thp") ? HEAP_HUGE_THP : HEAP_HUGE_TLB);
+        /* Regions only ever double from here, so they all stay whole
+         * huge pages.
+         */
+        while (heap_size < HEAP_HUGE_SIZE) {
+            heap_size <<= 1;
+        }
+    }
+    /* The slab algo is header-less already.
+     */
+    if ((val = getenv("MYMALLOC_HEADERLESS")) && !strcmp(val, "1")) {
+        headerless = heap_algo != &slab_algo;
+    }
+    arena_count = count < 1 ? 1 : count > HEAP_MAX_ARENAS ? HEAP_MAX_ARENAS : count;
+}
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Arena i, NULL if it hasn't been set up.
+ */
+struct heap_info *heap_get_arena(unsigned int i)
+{
+    if (i >= HEAP_ARENA_SLOTS || !__atomic_load_n(&arenas[i].initialized, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &arenas[i];
+}
+
+/* The arena a block from one of the regions belongs to, NULL for
+ * anything else.
+ */
+struct heap_info *heap_owner(void *ptr)
+{
+    int arena = heap_owns(ptr);
+    return arena ? &arenas[arena - 1] : NULL;
+}
+
+/* Map the first region of arena i and hand it to algo. Must be called
+ * with heap_lock held.
+ */
+static int init_arena(unsigned int i, struct alloc_algo *algo)
+{
+    struct heap_info *info = &arenas[i];
+    if (info->initialized) {
+        return 1;
+    }
+    info->arena = i;
+    info->size = heap_size;
+    info->grow_size = heap_size;
+    info->algo = algo;
+    info->algo_id = algo->id;
+    info->concurrent = algo->concurrent;
+    info->remote = NULL;
+    info->decay_at = now_ms() + decay_ms;
+    pthread_mutex_init(&info->lock, NULL);
+    info->heap = heap_map_region(info, info->size);
+    if (!info->heap) {
+        return 0;
+    }
+    info->mapped = info->size;
+    info->algo->init(info);
+    __atomic_store_n(&info->initialized, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int init_heap()
+{
+    pthread_mutex_lock(&heap_lock);
+    if (!heap_initialized) {
+        read_env();
+        if (init_arena(0, heap_algo)) {
+            heap_initialized = 1;
+            trace_init();
+            profile_init();
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return heap_initialized;
+}
+
+/* A thread whose arena can't be set up makes do with the first one,
+ * which exists by the time anything allocates.
+ */
+static struct heap_info *pick_arena()
+{
+    unsigned int i = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) % arena_count;
+    if (!__atomic_load_n(&arenas[i].initialized, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&heap_lock);
+        if (!init_arena(i, heap_algo)) {
+            i = 0;
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+    _arena = &arenas[i];
+    return _arena;
+}
+
+/* The arena the calling thread allocates from.
+ */
+static struct heap_info *thread_arena()
+{
+    return _arena ? _arena : pick_arena();
+}
+
+/* The small-object arena paired with the thread's arena, or that arena
+ * itself if the small one can't be set up.
+ */
+static struct heap_info *thread_small()
+{
+    unsigned int i;
+    if (_small) {
+        return _small;
+    }
+    i = thread_arena()->arena + HEAP_MAX_ARENAS;
+    if (!__atomic_load_n(&arenas[i].initialized, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&heap_lock);
+        if (!init_arena(i, &slab_algo)) {
+            i -= HEAP_MAX_ARENAS;
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+    _small = &arenas[i];
+    return _small;
+}
+
+/* Where the calling thread gets sz bytes from.
+ */
+static struct heap_info *arena_for(size_t sz)
+{
+    return headerless && sz <= HEAP_SMALL_MAX ? thread_small() : thread_arena();
+}
+
+/* Which of the calling thread's arenas a block from owner goes back
+ * through, which has to be one of the same algo.
+ */
+static struct heap_info *arena_like(struct heap_info *owner)
+{
+    struct heap_info *info = owner->arena < HEAP_MAX_ARENAS ? thread_arena() : thread_small();
+    return info->algo_id == owner->algo_id ? info : owner;
+}
+
+/* Map a new region big enough for a sz byte request and give it to the
+ * algo. Returns the region, NULL if we're out of memory.
+ */
+static char *heap_grow(struct heap_info *info, size_t sz, size_t *size)
+{
+    char *region;
+    if (sz > SIZE_MAX / 4) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *size = info->grow_size;
+    while (*size < sz + HEAP_GROW_SLACK) {
+        *size <<= 1;
+    }
+    region = heap_map_region(info, *size);
+    if (!region) {
+        return NULL;
+    }
+    if (info->algo->add_region(info, region, *size)) {
+        heap_unmap_region(region, *size);
+        return NULL;
+    }
+    info->mapped += *size;
+    if (info->grow_size < HEAP_MAX_GROW) {
+        info->grow_size <<= 1;
+    }
+    return region;
+}
+
+/* Push first..last, linked through their first words, onto the remote
+ * free stack of info. Doesn't need the lock.
+ */
+void heap_remote_free(struct heap_info *info, void *first, void *last)
+{
+    void *head = __atomic_load_n(&info->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) last = head;
+    } while (!__atomic_compare_exchange_n(&info->remote, &head, first, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free everything other threads have pushed onto the remote stack of
+ * info. Must be called with arena_lock held.
+ */
+static void heap_drain(struct heap_info *info)
+{
+    void *ptr = __atomic_exchange_n(&info->remote, NULL, __ATOMIC_ACQUIRE);
+    void *next;
+    while (ptr) {
+        next = *(void **) ptr;
+        algo_free(info, ptr);
+        ptr = next;
+    }
+}
+
+/* Run info->algo->purge under the real lock if the algo is concurrent.
+ * Must be called with arena_lock held.
+ */
+static size_t heap_purge(struct heap_info *info, int all)
+{
+    size_t ret;
+    if (info->concurrent) {
+        pthread_mutex_lock(&info->lock);
+    }
+    ret = info->algo->purge(info, all);
+    if (info->concurrent) {
+        pthread_mutex_unlock(&info->lock);
+    }
+    return ret;
+}
+
+/* Free pages go back to the OS once they have sat unused for between one
+ * and two decay periods: every decay_ms a pass over the arena purges the
+ * free blocks the last pass marked and marks the rest, so memory that
+ * keeps getting reused is never dropped only to be faulted back in. This
+ * runs from the allocation and free slow paths, so an arena nobody
+ * touches any more keeps its pages until malloc_trim. Must be called
+ * with arena_lock held.
+ */
+void heap_decay(struct heap_info *info)
+{
+    uint64_t now;
+    if (decay_ms < 0) {
+        return;
+    }
+    now = now_ms();
+    if (now < __atomic_load_n(&info->decay_at, __ATOMIC_RELAXED)) {
+        return;
+    }
+    /* Threads of a concurrent arena can all get here at once, one pass
+     * is enough.
+     */
+    if (__atomic_exchange_n(&info->decay_at, now + decay_ms, __ATOMIC_RELAXED) > now) {
+        return;
+    }
+    heap_purge(info, 0);
+}
+
+/* Must be called with arena_lock held. See tcache_malloc for fresh.
+ */
+void *heap_alloc(struct heap_info *info, size_t sz, int *fresh)
+{
+    char *ret;
+    char *region;
+    size_t size;
+    int tries;
+    if (__atomic_load_n(&info->remote, __ATOMIC_RELAXED)) {
+        heap_drain(info);
+    }
+    heap_decay(info);
+    ret = algo_malloc(info, sz);
+    if (ret) {
+        return ret;
+    }
+    /* Growing needs the real lock, and by the time we have it someone
+     * else may already have grown the heap.
+     */
+    if (info->concurrent) {
+        pthread_mutex_lock(&info->lock);
+        ret = algo_malloc(info, sz);
+    }
+    /* A region only just big enough isn't always: the buddy tree keeps its
+     * bitmaps in the first block, so its largest block is half the region.
+     * The second time round ask for twice as much.
+     */
+    for (tries = 0; !ret && tries < 2; tries++) {
+        if (!(region = heap_grow(info, sz << tries, &size))) {
+            break;
+        }
+        ret = algo_malloc(info, sz);
+        /* Nothing but the algo's own headers and free list links has
+         * touched the region yet, if the algo says so.
+         */
+        if (fresh && info->algo->fresh_zero && ret >= region && ret + sz <= region + size) {
+            *fresh = 1;
+        }
+    }
+    if (info->concurrent) {
+        pthread_mutex_unlock(&info->lock);
+    }
+    return ret;
+}
+
+/* What the algo can't find room for in one pass is left to heap_alloc,
+ * which grows the heap. Must be called with arena_lock held.
+ */
+static size_t heap_alloc_batch(struct heap_info *info, size_t sz, size_t n, void **ptrs)
+{
+    size_t got;
+    if (__atomic_load_n(&info->remote, __ATOMIC_RELAXED)) {
+        heap_drain(info);
+    }
+    got = info->algo->malloc_batch(info, sz, n, ptrs);
+    while (got < n && (ptrs[got] = heap_alloc(info, sz, NULL))) {
+        got++;
+    }
+    return got;
+}
+
+static void *heap_memalign(struct heap_info *info, size_t align, size_t sz)
+{
+    void *ret;
+    size_t size;
+    arena_lock(info);
+    if (__atomic_load_n(&info->remote, __ATOMIC_RELAXED)) {
+        heap_drain(info);
+    }
+    ret = algo_memalign(info, align, sz);
+    if (!ret && sz <= SIZE_MAX / 2 - align) {
+        if (info->concurrent) {
+            pthread_mutex_lock(&info->lock);
+        }
+        if (heap_grow(info, sz + 2 * align, &size)) {
+            ret = algo_memalign(info, align, sz);
+        }
+        if (info->concurrent) {
+            pthread_mutex_unlock(&info->lock);
+        }
+    }
+    arena_unlock(info);
+    return ret;
+}
+
+/* The entry points below are thin wrappers around these so the trace
+ * sees exactly one event per call, whatever they do internally.
+ */
+static void *do_malloc(size_t sz)
+{
+    if (!heap_initialized && !init_heap()) {
+        return NULL;
+    }
+    if (direct_wanted(sz)) {
+        return direct_malloc(sz, 0);
+    }
+    return tcache_malloc(arena_for(sz), sz, NULL);
+}
+
+static void do_free(void *ptr)
+{
+    struct heap_info *owner;
+    /* Nothing can have come from us before the heap exists.
+     */
+    if (!ptr) {
+        return;
+    }
+    if (!(owner = heap_owner(ptr))) {
+        direct_free(ptr);
+        return;
+    }
+    if (!heap_initialized) {
+        return;
+    }
+    tcache_free(arena_like(owner), ptr);
+}
+
+/* See free_sized.
+ */
+static void do_free_sized(void *ptr, size_t sz)
 {
-    _info.algo->init(&_info);
-    _info.initialized = 1;
+    struct heap_info *owner;
+    if (!ptr) {
+        return;
+    }
+    if (!(owner = heap_owner(ptr))) {
+        direct_free(ptr);
+        return;
+    }
+    if (!heap_initialized) {
+        return;
+    }
+    tcache_free_sized(arena_like(owner), ptr, sz);
+}
+
+static void *do_calloc(size_t total)
+{
+    struct heap_info *info;
+    int fresh;
+    void *ret;
+    if (!heap_initialized && !init_heap()) {
+        return NULL;
+    }
+    /* Straight from mmap, already zero.
+     */
+    if (direct_wanted(total)) {
+        return direct_malloc(total, 0);
+    }
+    info = arena_for(total);
+    ret = tcache_malloc(info, total, &fresh);
+    if (ret) {
+        memset(ret, 0, fresh && total > info->algo->link_size ? info->algo->link_size : total);
+    }
+    return ret;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    struct heap_info *owner;
+    if (!ptr) {
+        return 0;
+    }
+    if (!(owner = heap_owner(ptr))) {
+        return direct_usable_size(ptr);
+    }
+    return algo_usable_size(owner, ptr);
+}
+
+static void *do_realloc(void *ptr, size_t sz)
+{
+    struct heap_info *owner;
+    size_t old;
+    int resized;
+    void *ret;
+    if (!ptr) {
+        return do_malloc(sz);
+    }
+    if (!sz) {
+        do_free(ptr);
+        return NULL;
+    }
+    if (!(owner = heap_owner(ptr))) {
+        if (direct_wanted(sz) && (ret = direct_realloc(ptr, sz))) {
+            return ret;
+        }
+        old = direct_usable_size(ptr);
+    } else {
+        old = algo_usable_size(owner, ptr);
+    }
+    /* Don't bother with the lock for a shrink that wouldn't give back
+     * much.
+     */
+    if (sz <= old && sz >= old / 2) {
+        return ptr;
+    }
+    /* A block that has outgrown the heap gets moved to its own mapping
+     * rather than grown in place.
+     */
+    if (!owner || direct_wanted(sz)) {
+        goto move;
+    }
+    arena_lock(owner);
+    resized = algo_resize(owner, ptr, sz);
+    arena_unlock(owner);
+    if (resized) {
+        return ptr;
+    }
+move:
+    ret = do_malloc(sz);
+    if (ret) {
+        memcpy(ret, ptr, old < sz ? old : sz);
+        do_free(ptr);
+    }
+    return ret;
+}
+
+static void *do_memalign(size_t align, size_t sz)
+{
+    if (!heap_initialized && !init_heap()) {
+        return NULL;
+    }
+    if (direct_wanted(sz)) {
+        return direct_malloc(sz, align);
+    }
+    return heap_memalign(thread_arena(), align, sz);
 }
 
 void *malloc(size_t sz)
 {
-    if (!_info.initialized) {
-        init_heap();
+    void *ret = do_malloc(sz);
+    if (ret) {
+        STATS_ALLOC(sz, ret);
+    }
+    if (trace_active) {
+        trace_record(TRACE_MALLOC, ret, sz, 0);
     }
-    return _info.algo->malloc(sz);
+    if ((profile_left -= sz) < 0 && ret) {
+        profile_sample(ret, sz);
+    }
+    return ret;
 }
 
 void free(void *ptr)
 {
-    if (!_info.initialized) {
-        init_heap();
+    /* Before the block can be handed out again, so a replay sees the
+     * free first.
+     */
+    if (ptr) {
+        STATS_FREE(ptr);
+        if (trace_active) {
+            trace_record(TRACE_FREE, ptr, 0, 0);
+        }
+        if (profile_active) {
+            profile_free(ptr);
+        }
     }
-    _info.algo->free(ptr);
+    do_free(ptr);
 }
 
-void print_free_list()
+/* C23. sz has to be what ptr was asked for with, or for calloc the
+ * product of its arguments; with that the block itself doesn't have to
+ * be looked at to find where in the thread cache it goes.
+ */
+void free_sized(void *ptr, size_t sz)
+{
+    if (ptr) {
+        STATS_FREE(ptr);
+        if (trace_active) {
+            trace_record(TRACE_FREE, ptr, 0, 0);
+        }
+        if (profile_active) {
+            profile_free(ptr);
+        }
+    }
+    do_free_sized(ptr, sz);
+}
+
+/* A block aligned past the 16 bytes malloc gives can be much bigger than
+ * sz says, and past HEAP_ALIGN the tree backend hands out a pointer into
+ * the middle of one, so those go back the way free sends them.
+ */
+void free_aligned_sized(void *ptr, size_t align, size_t sz)
+{
+    if (align > 16) {
+        free(ptr);
+        return;
+    }
+    free_sized(ptr, sz);
+}
+
+void *calloc(size_t nmemb, size_t sz)
 {
-    if (!_info.initialized) {
-        init_heap();
-    }
-    _info.algo->print_free_list();
-}
-
-int main(int argc, char *argv[])
-{
-    struct block *tmp = (struct block *) heap;
-    int *p, *q, *r;
-    print_free_list();
-    p = malloc(sizeof(*p));
-    print_free_list();
-    q = malloc(sizeof(*q));
-    print_free_list();
-    r = malloc(sizeof(*r));
-    print_free_list();
-    free(q);
-    print_free_list();
-    free(p);
-    print_free_list();
-    free(r);
-    print_free_list();
+    size_t total;
+    void *ret;
+    if (__builtin_mul_overflow(nmemb, sz, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ret = do_calloc(total);
+    if (ret) {
+        STATS_ALLOC(total, ret);
+    }
+    if (trace_active) {
+        trace_record(TRACE_CALLOC, ret, total, 0);
+    }
+    if ((profile_left -= total) < 0 && ret) {
+        profile_sample(ret, total);
+    }
+    return ret;
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+    void *ret;
+    if (ptr) {
+        STATS_FREE(ptr);
+    }
+    ret = do_realloc(ptr, sz);
+    /* A failed realloc leaves the old block where it was, sample and all.
+     * If it did move, the old address may already be someone else's new
+     * sample, but that one went in after the old one and is found after
+     * it.
+     */
+    if (ptr && (ret || !sz) && profile_active) {
+        profile_free(ptr);
+    }
+    if (ret || (ptr && sz)) {
+        STATS_ALLOC(sz, ret ? ret : ptr);
+    }
+    if (trace_active) {
+        trace_record(TRACE_REALLOC, ret, sz, (uintptr_t) ptr);
+    }
+    if ((profile_left -= sz) < 0 && ret) {
+        profile_sample(ret, sz);
+    }
+    return ret;
+}
+
+/* n blocks of sz bytes into ptrs, taking the arena lock once for all of
+ * them and skipping the thread cache. Returns how many there are, fewer
+ * than n only if we ran out of memory.
+ */
+size_t malloc_batch(size_t sz, size_t n, void **ptrs)
+{
+    struct heap_info *info;
+    size_t got = 0;
+    size_t i;
+    if (!heap_initialized && !init_heap()) {
+        return 0;
+    }
+    if (direct_wanted(sz)) {
+        while (got < n && (ptrs[got] = direct_malloc(sz, 0))) {
+            got++;
+        }
+    } else {
+        info = arena_for(sz);
+        arena_lock(info);
+        got = heap_alloc_batch(info, sz, n, ptrs);
+        arena_unlock(info);
+    }
+    for (i = 0; i < got; i++) {
+        STATS_ALLOC(sz, ptrs[i]);
+        if (trace_active) {
+            trace_record(TRACE_MALLOC, ptrs[i], sz, 0);
+        }
+        if ((profile_left -= sz) < 0) {
+            profile_sample(ptrs[i], sz);
+        }
+    }
+    if (got < n) {
+        errno = ENOMEM;
+    }
+    return got;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(void * const *) a;
+    uintptr_t y = (uintptr_t) *(void * const *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Free n blocks at once. ptrs is sorted by address in place, then each
+ * run of blocks from the same arena goes back in one call to the algo,
+ * or onto the arena's remote free stack in one push if it isn't ours.
+ * NULLs are skipped.
+ */
+void free_batch(size_t n, void **ptrs)
+{
+    struct heap_info *info;
+    struct heap_info *owner;
+    size_t i;
+    size_t j;
+    size_t k;
+    for (i = 0; i < n; i++) {
+        if (ptrs[i]) {
+            STATS_FREE(ptrs[i]);
+            if (trace_active) {
+                trace_record(TRACE_FREE, ptrs[i], 0, 0);
+            }
+            if (profile_active) {
+                profile_free(ptrs[i]);
+            }
+        }
+    }
+    qsort(ptrs, n, sizeof(*ptrs), ptr_cmp);
+    for (i = 0; i < n && !ptrs[i]; i++)
+        ;
+    while (i < n) {
+        owner = heap_owner(ptrs[i]);
+        for (j = i + 1; j < n && heap_owner(ptrs[j]) == owner; j++)
+            ;
+        if (!owner) {
+            for (; i < j; i++) {
+                direct_free(ptrs[i]);
+            }
+            continue;
+        }
+        info = arena_like(owner);
+        if (owner == info) {
+            arena_lock(info);
+            info->algo->free_batch(info, j - i, ptrs + i);
+            heap_decay(info);
+            arena_unlock(info);
+        } else {
+            for (k = i; k + 1 < j; k++) {
+                *(void **) ptrs[k] = ptrs[k + 1];
+            }
+            heap_remote_free(owner, ptrs[i], ptrs[j - 1]);
+        }
+        i = j;
+    }
+}
+
+/* glibc's own reallocarray doesn't go through realloc, so a preloaded
+ * allocator has to provide it too.
+ */
+void *reallocarray(void *ptr, size_t nmemb, size_t sz)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, sz, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+void *memalign(size_t align, size_t sz)
+{
+    void *ret;
+    if (!align || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ret = do_memalign(align, sz);
+    if (ret) {
+        STATS_ALLOC(sz, ret);
+    }
+    if (trace_active) {
+        trace_record(TRACE_MEMALIGN, ret, sz, align);
+    }
+    if ((profile_left -= sz) < 0 && ret) {
+        profile_sample(ret, sz);
+    }
+    return ret;
+}
+
+void *aligned_alloc(size_t align, size_t sz)
+{
+    return memalign(align, sz);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t sz)
+{
+    void *ret;
+    if (!align || align % sizeof(void *) || (align & (align - 1))) {
+        return EINVAL;
+    }
+    ret = memalign(align, sz);
+    if (!ret) {
+        return ENOMEM;
+    }
+    *memptr = ret;
     return 0;
 }
+
+void *valloc(size_t sz)
+{
+    return memalign(sysconf(_SC_PAGESIZE), sz);
+}
+
+void *pvalloc(size_t sz)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (sz + page - 1) & ~(page - 1));
+}
+
+/* Only M_MMAP_THRESHOLD is understood. Returns 1 on success like glibc.
+ */
+int mallopt(int param, int value)
+{
+    if (param == M_MMAP_THRESHOLD && value >= 0 && value <= MMAP_THRESHOLD_MAX) {
+        direct_set_threshold(value);
+        return 1;
+    }
+    return 0;
+}
+
+/* Give every free page in the heap back to the OS now, whatever its age.
+ * There is no top of the heap to keep pad bytes at, so pad is ignored.
+ * Returns 1 if anything was given back, like glibc.
+ */
+int malloc_trim(size_t pad)
+{
+    struct heap_info *info;
+    size_t purged = 0;
+    unsigned int i;
+    (void) pad;
+    for (i = 0; i < HEAP_ARENA_SLOTS; i++) {
+        if (!(info = heap_get_arena(i))) {
+            continue;
+        }
+        arena_lock(info);
+        if (__atomic_load_n(&info->remote, __ATOMIC_RELAXED)) {
+            heap_drain(info);
+        }
+        purged += heap_purge(info, 1);
+        arena_unlock(info);
+    }
+    return purged > 0;
+}
+
+void print_free_list()
+{
+    struct heap_info *info;
+    unsigned int i;
+    if (!heap_initialized && !init_heap()) {
+        return;
+    }
+    for (i = 0; i < HEAP_ARENA_SLOTS; i++) {
+        if ((info = heap_get_arena(i))) {
+            printf("Arena %u:\n", i);
+            info->algo->print_free_list(info);
+        }
+    }
+}
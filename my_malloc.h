@@ -0,0 +1,121 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Extensions on top of the standard malloc interface, for programs that
+ * know they're linked against this allocator.
+ */
+#ifndef _MY_MALLOC_H
+#define _MY_MALLOC_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pick the backend by name ("fat", "thin", "tlsf", "tree", "ctree" or
+ * "slab") instead of the one chosen at compile time. Only possible before the
+ * first allocation; returns nonzero if it's too late or the name is
+ * unknown.
+ */
+int malloc_set_algo(const char *name);
+const char *malloc_algo_name();
+
+/* Allocate n blocks of sz bytes each into ptrs, taking the arena lock
+ * once for the lot. Returns how many it got, fewer than n only when out
+ * of memory.
+ */
+size_t malloc_batch(size_t sz, size_t n, void **ptrs);
+
+/* Free the n blocks in ptrs, which may hold NULLs and is left sorted by
+ * address.
+ */
+void free_batch(size_t n, void **ptrs);
+
+/* C23 sized deallocation, for compilers and C libraries that don't
+ * declare them yet. sz has to be the size the block was asked for with,
+ * and the thread cache files the block by it without looking at the
+ * block; aligned blocks have to go back through free_aligned_sized.
+ */
+void free_sized(void *ptr, size_t sz);
+void free_aligned_sized(void *ptr, size_t align, size_t sz);
+
+/* Bump arenas for objects that are all freed together, see bump.c.
+ * Allocations are 16 byte aligned and can't be freed one by one; reset
+ * frees everything allocated from the arena but keeps its memory for
+ * reuse, destroy gives it all back. Not to be shared between threads
+ * without locking.
+ */
+struct bump_arena;
+
+struct bump_arena *bump_arena_create(size_t chunk_size);
+void *bump_arena_alloc(struct bump_arena *a, size_t sz);
+void bump_arena_reset(struct bump_arena *a);
+void bump_arena_destroy(struct bump_arena *a);
+
+/* Persistent heaps kept in a file, see pheap.c. Blocks are 16 byte
+ * aligned and only ever freed with pheap_free. Objects in the heap point
+ * at each other by offset, since it needn't be mapped at the same address
+ * the next time; the root is where a reopened heap starts from. Safe to
+ * share between threads, but only one process has a heap open at a time.
+ * A heap whose process died without closing it only opens again with
+ * pheap_recover.
+ */
+struct pheap;
+
+struct pheap *pheap_open(const char *path, size_t size);
+struct pheap *pheap_recover(const char *path, size_t size);
+int pheap_close(struct pheap *ph);
+void *pheap_alloc(struct pheap *ph, size_t sz);
+void pheap_free(struct pheap *ph, void *ptr);
+size_t pheap_usable_size(struct pheap *ph, void *ptr);
+void *pheap_root(struct pheap *ph);
+void pheap_set_root(struct pheap *ph, void *ptr);
+size_t pheap_offset(struct pheap *ph, void *ptr);
+void *pheap_pointer(struct pheap *ph, size_t offset);
+
+/* Bytes currently mapped from the OS, heap regions and direct mappings
+ * together.
+ */
+size_t malloc_mapped_bytes();
+
+#define MALLOC_STATS_CLASSES 32
+
+/* Filled in by malloc_get_stats, which is only there when the allocator
+ * is built with -DMALLOC_STATS.
+ */
+struct malloc_stats {
+    /* Blocks the program holds, in usable bytes.
+     */
+    size_t in_use_bytes;
+    size_t in_use_blocks;
+    /* Highest in_use_bytes has been. Threads only report their share
+     * every 64 KiB or so, so it can be off by that much per thread.
+     */
+    size_t peak_in_use_bytes;
+    size_t mapped_bytes;
+    /* Free space in the heap as the backend sees it. Blocks parked in a
+     * thread cache count as in use there.
+     */
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free;
+    /* requests[i] counts requests of up to 16 << i bytes, the last
+     * bucket takes everything bigger.
+     */
+    uint64_t requests[MALLOC_STATS_CLASSES];
+};
+
+/* Returns nonzero if statistics weren't compiled in.
+ */
+int malloc_get_stats(struct malloc_stats *st);
+
+/* Write the sampled heap profile to path in the format pprof reads, see
+ * profile.h for turning sampling on. Returns nonzero on failure.
+ */
+int malloc_profile_dump(const char *path);
+
+void print_free_list();
+#endif
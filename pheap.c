@@ -0,0 +1,279 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Persistent heaps, kept in a file so a process that restarts can map it
+ * again and pick up its objects where it left them instead of building
+ * them all over.
+ *
+ * The file is one tree_malloc.c region, a power of two in size, followed
+ * by a page of header. The region keeps everything it knows about its
+ * blocks as offsets from its own start, so it works wherever the file is
+ * mapped; objects in it have to do the same for pointers to each other,
+ * see pheap_offset and pheap_pointer. The header has the offset of one
+ * root object to find the rest from.
+ *
+ * The mapping is shared, so the page cache writes everything back on its
+ * own time, and pheap_close makes sure all of it has. A heap that was
+ * never closed may have been left halfway through an update, so the
+ * header is marked dirty while it's open and a dirty heap won't open
+ * again. pheap_recover opens one anyway and makes the free lists over from
+ * the region's bitmaps, which are all that's needed to tell which blocks
+ * are in use. The file is locked while open, so only one process has it
+ * at a time.
+ *
+ * Persistent heaps are nothing to do with the arenas: their blocks only
+ * go back through pheap_free, never free.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "heap.h"
+#include "my_malloc.h"
+
+#define PHEAP_MAGIC "mymheap1"
+
+struct pheap_header {
+    char magic[8];
+    /* Of the region, not counting the header.
+     */
+    uint64_t size;
+    /* Offset of the root object in the region, 0 for none.
+     */
+    uint64_t root;
+    /* Cleared while the heap is open.
+     */
+    uint64_t clean;
+};
+
+struct pheap {
+    int fd;
+    char *base;
+    size_t size;
+    size_t page;
+    struct pheap_header *header;
+    pthread_mutex_t lock;
+};
+
+/* Map the region size bytes of fd with its header after it, the region
+ * on a HEAP_ALIGN boundary like any other so its blocks line up the same.
+ */
+static char *map_file(int fd, size_t size, size_t page)
+{
+    char *map;
+    char *start;
+    size_t len = size + page + HEAP_ALIGN;
+    map = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    start = (char *) (((uintptr_t) map + HEAP_ALIGN - 1) & ~(uintptr_t) (HEAP_ALIGN - 1));
+    if (mmap(start, size + page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(map, len);
+        return NULL;
+    }
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    if (map + len > start + size + page) {
+        munmap(start + size + page, map + len - (start + size + page));
+    }
+    return start;
+}
+
+/* A new file gets a fresh heap of size bytes, rounded up to a power of
+ * two and at least HEAP_ALIGN.
+ */
+static int create_heap(struct pheap *ph, size_t size)
+{
+    size_t want = HEAP_ALIGN;
+    while (want < size) {
+        if (want > SIZE_MAX / 4) {
+            errno = ENOMEM;
+            return -1;
+        }
+        want <<= 1;
+    }
+    /* Mapped before the file grows, so it stays empty if either fails
+     * and the next open starts over.
+     */
+    if (!(ph->base = map_file(ph->fd, want, ph->page))) {
+        return -1;
+    }
+    if (ftruncate(ph->fd, want + ph->page)) {
+        munmap(ph->base, want + ph->page);
+        return -1;
+    }
+    ph->size = want;
+    ph->header = (struct pheap_header *) (ph->base + want);
+    /* Can't fail for a power of two this big.
+     */
+    tree_region_format(ph->base, want);
+    memcpy(ph->header->magic, PHEAP_MAGIC, sizeof(ph->header->magic));
+    ph->header->size = want;
+    ph->header->root = 0;
+    return 0;
+}
+
+static int load_heap(struct pheap *ph, off_t file_size, int recover)
+{
+    struct pheap_header header;
+    if (file_size < (off_t) ph->page
+            || pread(ph->fd, &header, sizeof(header), file_size - ph->page) != sizeof(header)
+            || memcmp(header.magic, PHEAP_MAGIC, sizeof(header.magic))
+            || (off_t) header.size != file_size - (off_t) ph->page) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!header.clean && !recover) {
+        errno = EUCLEAN;
+        return -1;
+    }
+    if (!(ph->base = map_file(ph->fd, header.size, ph->page))) {
+        return -1;
+    }
+    ph->size = header.size;
+    ph->header = (struct pheap_header *) (ph->base + header.size);
+    if (tree_region_attach(ph->base, ph->size)) {
+        munmap(ph->base, ph->size + ph->page);
+        errno = EINVAL;
+        return -1;
+    }
+    if (!header.clean) {
+        tree_region_rebuild(ph->base);
+        if (ph->header->root >= ph->size) {
+            ph->header->root = 0;
+        }
+    }
+    return 0;
+}
+
+static struct pheap *open_heap(const char *path, size_t size, int recover)
+{
+    struct pheap *ph = malloc(sizeof(*ph));
+    struct stat st;
+    int err;
+    if (!ph) {
+        return NULL;
+    }
+    ph->page = sysconf(_SC_PAGESIZE);
+    if ((ph->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        free(ph);
+        return NULL;
+    }
+    if (flock(ph->fd, LOCK_EX | LOCK_NB) || fstat(ph->fd, &st)
+            || (st.st_size ? load_heap(ph, st.st_size, recover) : create_heap(ph, size))) {
+        err = errno;
+        close(ph->fd);
+        free(ph);
+        errno = err;
+        return NULL;
+    }
+    /* Dirty before anything in the region can change.
+     */
+    ph->header->clean = 0;
+    msync(ph->header, ph->page, MS_SYNC);
+    pthread_mutex_init(&ph->lock, NULL);
+    return ph;
+}
+
+/* Opens the heap in path, or makes a new one of size bytes if the file
+ * doesn't exist or is empty; size is ignored otherwise. NULL with errno
+ * set on failure, EUCLEAN for a heap that wasn't closed and EWOULDBLOCK
+ * for one some other process has open.
+ */
+struct pheap *pheap_open(const char *path, size_t size)
+{
+    return open_heap(path, size, 0);
+}
+
+/* Like pheap_open, but a heap that wasn't closed is opened too, with its
+ * free lists rebuilt. Whatever the process was doing to its objects when
+ * it died is left as it was, and a block it was allocating or freeing
+ * just then may stay allocated.
+ */
+struct pheap *pheap_recover(const char *path, size_t size)
+{
+    return open_heap(path, size, 1);
+}
+
+/* Writes everything back and marks the heap clean, then unmaps it.
+ * Nothing from it can be used after this. Returns nonzero if it couldn't
+ * all be written, in which case the heap stays dirty.
+ */
+int pheap_close(struct pheap *ph)
+{
+    int ret = msync(ph->base, ph->size, MS_SYNC);
+    if (!ret) {
+        ph->header->clean = 1;
+        ret = msync(ph->header, ph->page, MS_SYNC);
+    }
+    munmap(ph->base, ph->size + ph->page);
+    close(ph->fd);
+    pthread_mutex_destroy(&ph->lock);
+    free(ph);
+    return ret;
+}
+
+void *pheap_alloc(struct pheap *ph, size_t sz)
+{
+    void *ret;
+    pthread_mutex_lock(&ph->lock);
+    ret = tree_region_alloc(ph->base, sz);
+    pthread_mutex_unlock(&ph->lock);
+    if (!ret) {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+void pheap_free(struct pheap *ph, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    pthread_mutex_lock(&ph->lock);
+    tree_region_free(ph->base, ptr);
+    pthread_mutex_unlock(&ph->lock);
+}
+
+size_t pheap_usable_size(struct pheap *ph, void *ptr)
+{
+    return ptr ? tree_region_usable_size(ph->base, ptr) : 0;
+}
+
+void *pheap_root(struct pheap *ph)
+{
+    return pheap_pointer(ph, __atomic_load_n(&ph->header->root, __ATOMIC_ACQUIRE));
+}
+
+void pheap_set_root(struct pheap *ph, void *ptr)
+{
+    __atomic_store_n(&ph->header->root, pheap_offset(ph, ptr), __ATOMIC_RELEASE);
+}
+
+/* For storing pointers to other objects of the heap in its objects: the
+ * offset stays the same from one mapping to the next. NULL is 0, which
+ * no block is ever at.
+ */
+size_t pheap_offset(struct pheap *ph, void *ptr)
+{
+    return ptr ? (size_t) ((char *) ptr - ph->base) : 0;
+}
+
+void *pheap_pointer(struct pheap *ph, size_t offset)
+{
+    return offset ? ph->base + offset : NULL;
+}
@@ -0,0 +1,361 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Sampling side of the heap profile, see profile.h. Sampling runs inside
+ * malloc, so nothing here allocates: the table of sampled blocks is
+ * mapped once at start up and the dump builds its own working space with
+ * mmap too.
+ */
+#define _GNU_SOURCE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "my_malloc.h"
+#include "profile.h"
+
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BITS 16
+#define PROFILE_SLOTS (1 << PROFILE_BITS)
+/* Samples past this many live ones are dropped, which keeps the probe
+ * sequences short.
+ */
+#define PROFILE_MAX_LIVE (PROFILE_SLOTS / 4 * 3)
+#define PROFILE_HOME(ptr) (((uintptr_t) (ptr) >> 4) * 0x9e3779b97f4a7c15ULL >> (64 - PROFILE_BITS))
+
+struct profile_entry {
+    void *ptr;
+    size_t size;
+    unsigned int depth;
+    void *stack[PROFILE_MAX_DEPTH];
+};
+
+/* One line of the dump, the live samples with the same stack.
+ */
+struct profile_bucket {
+    struct profile_entry *entry;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+int profile_active = 0;
+__thread long profile_left = 0;
+
+static size_t profile_rate;
+static const char *profile_path;
+static int profile_atexit_done = 0;
+/* Open addressing with linear probing; a NULL ptr marks an empty slot.
+ */
+static struct profile_entry *profile_table;
+static unsigned int profile_live = 0;
+/* How many live samples have each slot as their home. free only takes
+ * the lock when the one for its pointer is set.
+ */
+static unsigned short profile_homes[PROFILE_SLOTS];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread uint64_t profile_rng;
+/* Set once the thread has drawn its first interval. Until then
+ * profile_left is the 0 every thread starts with, which runs out on the
+ * first request whatever the rate.
+ */
+static __thread int profile_started;
+/* Set while a sample is being taken, backtrace can allocate the first
+ * time it runs.
+ */
+static __thread int profile_busy;
+
+/* Called once, with the heap lock held, when the heap is set up.
+ */
+void profile_init()
+{
+    const char *val;
+    profile_path = getenv("MYMALLOC_PROFILE");
+    if (profile_path && !*profile_path) {
+        profile_path = NULL;
+    }
+    if ((val = getenv("MYMALLOC_PROFILE_RATE")) && *val) {
+        profile_rate = strtoull(val, NULL, 0);
+    } else if (profile_path) {
+        profile_rate = PROFILE_DEFAULT_RATE;
+    }
+    if (!profile_rate) {
+        return;
+    }
+    profile_table = mmap(NULL, PROFILE_SLOTS * sizeof(struct profile_entry),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (profile_table == MAP_FAILED) {
+        profile_table = NULL;
+        return;
+    }
+    __atomic_store_n(&profile_active, 1, __ATOMIC_RELEASE);
+}
+
+/* Bytes until the next sample, exponentially distributed with a mean of
+ * profile_rate.
+ */
+static long profile_next()
+{
+    struct timespec ts;
+    double u, ret;
+    if (!profile_rng) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        profile_rng = ((uintptr_t) &profile_rng ^ ts.tv_nsec) | 1;
+    }
+    profile_rng ^= profile_rng >> 12;
+    profile_rng ^= profile_rng << 25;
+    profile_rng ^= profile_rng >> 27;
+    u = ((profile_rng * 0x2545f4914f6cdd1dULL >> 11) + 1) * 0x1p-53;
+    ret = -log(u) * profile_rate;
+    return ret < LONG_MAX / 2 ? (long) ret : LONG_MAX / 2;
+}
+
+static void profile_at_exit()
+{
+    malloc_profile_dump(profile_path);
+}
+
+static void profile_insert(void *ptr, size_t size, void **stack, int depth)
+{
+    struct profile_entry *e;
+    unsigned int home = PROFILE_HOME(ptr);
+    unsigned int i = home;
+    pthread_mutex_lock(&profile_lock);
+    if (profile_live < PROFILE_MAX_LIVE) {
+        while (profile_table[i].ptr) {
+            i = (i + 1) & (PROFILE_SLOTS - 1);
+        }
+        e = &profile_table[i];
+        e->ptr = ptr;
+        e->size = size;
+        e->depth = depth;
+        for (i = 0; i < (unsigned int) depth; i++) {
+            e->stack[i] = stack[i];
+        }
+        profile_live++;
+        __atomic_store_n(&profile_homes[home], profile_homes[home] + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* ptr has just been handed out for a request of size bytes and used up
+ * what was left of the thread's sampling interval.
+ */
+void profile_sample(void *ptr, size_t size)
+{
+    void *stack[PROFILE_MAX_DEPTH + 1];
+    int depth;
+    if (!__atomic_load_n(&profile_active, __ATOMIC_ACQUIRE)) {
+        profile_left = LONG_MAX;
+        return;
+    }
+    if (!profile_started) {
+        /* Count this request against a real interval instead.
+         */
+        profile_started = 1;
+        profile_left = profile_next() - (long) (size < LONG_MAX / 2 ? size : LONG_MAX / 2);
+        if (profile_left >= 0) {
+            return;
+        }
+    }
+    profile_left = profile_next();
+    if (profile_busy) {
+        return;
+    }
+    profile_busy = 1;
+    /* Not in profile_init, atexit may allocate and that can't happen
+     * under the heap lock.
+     */
+    if (profile_path && !__atomic_exchange_n(&profile_atexit_done, 1, __ATOMIC_RELAXED)) {
+        atexit(profile_at_exit);
+    }
+    /* Leaving out this function's own frame.
+     */
+    depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+    if (depth > 1) {
+        profile_insert(ptr, size, stack + 1, depth - 1);
+    }
+    profile_busy = 0;
+}
+
+/* Backward shift deletion, so lookups never need tombstones.
+ */
+static void remove_entry(unsigned int i)
+{
+    unsigned int j = i;
+    unsigned int home;
+    for (;;) {
+        profile_table[i].ptr = NULL;
+        do {
+            j = (j + 1) & (PROFILE_SLOTS - 1);
+            if (!profile_table[j].ptr) {
+                return;
+            }
+            home = PROFILE_HOME(profile_table[j].ptr);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        profile_table[i] = profile_table[j];
+        i = j;
+    }
+}
+
+void profile_free(void *ptr)
+{
+    unsigned int home = PROFILE_HOME(ptr);
+    unsigned int i = home;
+    if (!__atomic_load_n(&profile_homes[home], __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    while (profile_table[i].ptr && profile_table[i].ptr != ptr) {
+        i = (i + 1) & (PROFILE_SLOTS - 1);
+    }
+    if (profile_table[i].ptr) {
+        remove_entry(i);
+        profile_live--;
+        __atomic_store_n(&profile_homes[home], profile_homes[home] - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static uint64_t stack_hash(const struct profile_entry *e)
+{
+    uint64_t ret = e->depth;
+    unsigned int i;
+    for (i = 0; i < e->depth; i++) {
+        ret = (ret ^ (uintptr_t) e->stack[i]) * 0x100000001b3ULL;
+    }
+    return ret ^ ret >> 29;
+}
+
+static int same_stack(const struct profile_entry *a, const struct profile_entry *b)
+{
+    unsigned int i;
+    if (a->depth != b->depth) {
+        return 0;
+    }
+    for (i = 0; i < a->depth; i++) {
+        if (a->stack[i] != b->stack[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The process's mappings go at the end so pprof can symbolize the
+ * addresses.
+ */
+static int write_maps(int fd)
+{
+    char buf[4096];
+    ssize_t n;
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0) {
+        return -1;
+    }
+    dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+    while ((n = read(maps, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    close(maps);
+    return n ? -1 : 0;
+}
+
+/* Legacy text heap profile, heap_v2 flavour: pprof scales the sampled
+ * counts back up using the rate in the header. Everything live is also
+ * reported as allocated, past allocations aren't kept.
+ */
+int malloc_profile_dump(const char *path)
+{
+    struct profile_entry *copy = NULL;
+    struct profile_bucket *buckets = NULL;
+    struct profile_bucket *b;
+    size_t copy_size = 0, buckets_size = 0, mask = 0;
+    uint64_t count = 0, bytes = 0;
+    unsigned int n = 0, i, j;
+    int fd, ret = -1;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&profile_lock);
+    if (profile_live) {
+        copy_size = profile_live * sizeof(*copy);
+        copy = mmap(NULL, copy_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            pthread_mutex_unlock(&profile_lock);
+            goto out;
+        }
+        for (i = 0; i < PROFILE_SLOTS; i++) {
+            if (profile_table[i].ptr) {
+                copy[n++] = profile_table[i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    if (n) {
+        for (mask = 1; mask < 2 * (size_t) n; mask <<= 1)
+            ;
+        buckets_size = mask * sizeof(*buckets);
+        mask--;
+        buckets = mmap(NULL, buckets_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buckets == MAP_FAILED) {
+            buckets = NULL;
+            goto out;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        for (j = stack_hash(&copy[i]) & mask; (b = &buckets[j])->entry; j = (j + 1) & mask) {
+            if (same_stack(b->entry, &copy[i])) {
+                break;
+            }
+        }
+        b->entry = &copy[i];
+        b->count++;
+        b->bytes += copy[i].size;
+        count++;
+        bytes += copy[i].size;
+    }
+    dprintf(fd, "heap profile: %llu: %llu [ %llu: %llu] @ heap_v2/%zu\n",
+            (unsigned long long) count, (unsigned long long) bytes,
+            (unsigned long long) count, (unsigned long long) bytes, profile_rate);
+    for (j = 0; buckets && j <= mask; j++) {
+        if (!(b = &buckets[j])->entry) {
+            continue;
+        }
+        dprintf(fd, "%llu: %llu [ %llu: %llu] @",
+                (unsigned long long) b->count, (unsigned long long) b->bytes,
+                (unsigned long long) b->count, (unsigned long long) b->bytes);
+        for (i = 0; i < b->entry->depth; i++) {
+            dprintf(fd, " %p", b->entry->stack[i]);
+        }
+        dprintf(fd, "\n");
+    }
+    ret = write_maps(fd);
+out:
+    if (copy && copy != MAP_FAILED) {
+        munmap(copy, copy_size);
+    }
+    if (buckets) {
+        munmap(buckets, buckets_size);
+    }
+    if (close(fd)) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,40 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Sampled heap profile. With MYMALLOC_PROFILE_RATE set to a number of
+ * bytes, allocations are picked so that on average one is sampled per
+ * that many bytes asked for, the gaps between them drawn from an
+ * exponential distribution so that no allocation pattern can line up
+ * with them. Each sampled block's call stack is kept until it is freed,
+ * and malloc_profile_dump writes the live ones out as a heap profile pprof
+ * reads:
+ *
+ *     MYMALLOC_PROFILE_RATE=524288 MYMALLOC_PROFILE=/tmp/app.heap ./app
+ *     go tool pprof -top ./app /tmp/app.heap
+ *
+ * MYMALLOC_PROFILE names a file the profile is written to at exit, for
+ * programs that don't call malloc_profile_dump themselves; on its own it
+ * samples every 512 KiB.
+ *
+ * The entry points count every request down against profile_left and
+ * only call in here once it goes negative. With profiling off it is
+ * reset to LONG_MAX, so the cost is that one subtraction. Each thread
+ * starts at 0 and draws its first interval on that first call.
+ */
+#ifndef _PROFILE_H
+#define _PROFILE_H
+#include <stddef.h>
+
+extern int profile_active;
+extern __thread long profile_left;
+
+void profile_init();
+void profile_sample(void *ptr, size_t size);
+void profile_free(void *ptr);
+#endif
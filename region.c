@@ -0,0 +1,220 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Getting memory from the OS. Every region the heap is built from is
+ * mapped here, HEAP_ALIGN aligned so the backends can rely on it (the
+ * buddy blocks in tree_malloc.c line up with their size, slab pages don't
+ * need any slop).
+ *
+ * Regions are also entered in a two level radix map with one byte per
+ * HEAP_ALIGN chunk of address space, so heap_owns can tell a heap pointer
+ * from one of the direct mappings in direct_malloc.c with two loads. The
+ * byte is one more than the arena the region belongs to, which is how a
+ * free finds the arena to give the block back to. A second map of the
+ * same shape holds the start of each region, for backends that keep
+ * their per-region metadata there rather than in front of every block.
+ *
+ * In huge page mode every region is a whole number of HEAP_HUGE_SIZE
+ * pages on a HEAP_HUGE_SIZE boundary, so the kernel can back it with huge
+ * pages from the first fault and the TLB holds 512 times as much of the
+ * heap. Decay purging then only drops whole huge pages, because dropping
+ * part of one would split it back into small pages; malloc_trim still
+ * takes everything it can.
+ */
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "heap.h"
+
+/* The map covers 48 bits of address space, which is all a process gets
+ * unless it asks for more under 5-level paging. Anything past that, from
+ * such a mapping or a pointer that was never ours, is in no region.
+ */
+#define MAP_LEAF_BITS 14
+#define MAP_ROOT_BITS (48 - HEAP_ALIGN_SHIFT - MAP_LEAF_BITS)
+#define MAP_ROOTS ((uintptr_t) 1 << MAP_ROOT_BITS)
+#define MAP_ROOT(addr) ((uintptr_t) (addr) >> (HEAP_ALIGN_SHIFT + MAP_LEAF_BITS))
+#define MAP_LEAF(addr) (((uintptr_t) (addr) >> HEAP_ALIGN_SHIFT) & ((1 << MAP_LEAF_BITS) - 1))
+
+/* Leaves of arena bytes and of region starts.
+ */
+static void *heap_map[MAP_ROOTS];
+static void *base_map[MAP_ROOTS];
+static enum heap_huge huge_mode = HEAP_HUGE_NONE;
+
+/* The leaf of map covering addr, entries of entry_size bytes. NULL if
+ * addr is past the map, so a region up there fails to map.
+ */
+static void *map_leaf(void **map, char *addr, size_t entry_size)
+{
+    void **slot;
+    void *leaf;
+    void *expected = NULL;
+    size_t size = entry_size << MAP_LEAF_BITS;
+    if (MAP_ROOT(addr) >= MAP_ROOTS) {
+        return NULL;
+    }
+    slot = &map[MAP_ROOT(addr)];
+    leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (leaf) {
+        return leaf;
+    }
+    leaf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (leaf == MAP_FAILED) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(slot, &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(leaf, size);
+        leaf = expected;
+    }
+    return leaf;
+}
+
+/* A value of 0 takes the region out of both maps.
+ */
+static int map_set(char *base, size_t size, unsigned char value)
+{
+    char *addr;
+    unsigned char *leaf;
+    char **bases;
+    for (addr = base; addr < base + size; addr += HEAP_ALIGN) {
+        if (!(leaf = map_leaf(heap_map, addr, 1)) || !(bases = map_leaf(base_map, addr, sizeof(char *)))) {
+            return -1;
+        }
+        leaf[MAP_LEAF(addr)] = value;
+        bases[MAP_LEAF(addr)] = value ? base : NULL;
+    }
+    return 0;
+}
+
+/* 0 if ptr isn't in any region, otherwise one more than its arena.
+ */
+int heap_owns(void *ptr)
+{
+    unsigned char *leaf;
+    if (MAP_ROOT(ptr) >= MAP_ROOTS) {
+        return 0;
+    }
+    leaf = __atomic_load_n(&heap_map[MAP_ROOT(ptr)], __ATOMIC_ACQUIRE);
+    return leaf ? leaf[MAP_LEAF(ptr)] : 0;
+}
+
+/* Start of the region ptr is in, NULL if it isn't in one.
+ */
+char *heap_region_of(void *ptr)
+{
+    char **bases;
+    if (MAP_ROOT(ptr) >= MAP_ROOTS) {
+        return NULL;
+    }
+    bases = __atomic_load_n(&base_map[MAP_ROOT(ptr)], __ATOMIC_ACQUIRE);
+    return bases ? bases[MAP_LEAF(ptr)] : NULL;
+}
+
+/* Has to be called before the first region is mapped, and then size
+ * has to be a multiple of HEAP_HUGE_SIZE for every region unless mode is
+ * HEAP_HUGE_NONE.
+ */
+void heap_set_huge(enum heap_huge mode)
+{
+    huge_mode = mode;
+}
+
+/* Map size bytes on an align boundary, by mapping align more and
+ * trimming off both ends.
+ */
+static char *map_aligned(size_t size, size_t align)
+{
+    char *map;
+    char *start;
+    size_t len = size + align;
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    start = (char *) (((uintptr_t) map + align - 1) & ~(uintptr_t) (align - 1));
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    if (map + len > start + size) {
+        munmap(start + size, map + len - (start + size));
+    }
+    return start;
+}
+
+/* hugetlbfs mappings come out aligned to the huge page size.
+ */
+static char *map_hugetlb(size_t size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    char *map;
+#ifdef MAP_HUGE_SHIFT
+    flags |= HEAP_HUGE_SHIFT << MAP_HUGE_SHIFT;
+#endif
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+char *heap_map_region(struct heap_info *info, size_t size)
+{
+    char *start = NULL;
+    if (huge_mode == HEAP_HUGE_TLB) {
+        start = map_hugetlb(size);
+    }
+    if (!start) {
+        start = map_aligned(size, huge_mode ? HEAP_HUGE_SIZE : HEAP_ALIGN);
+        if (!start) {
+            return NULL;
+        }
+        if (huge_mode) {
+            madvise(start, size, MADV_HUGEPAGE);
+        }
+    }
+    if (map_set(start, size, info->arena + 1)) {
+        /* Takes back whatever part of it did go in.
+         */
+        map_set(start, size, 0);
+        munmap(start, size);
+        return NULL;
+    }
+    return start;
+}
+
+void heap_unmap_region(char *base, size_t size)
+{
+    map_set(base, size, 0);
+    munmap(base, size);
+}
+
+/* Drop the whole pages between start and end if there are at least min
+ * bytes of them. A min of 0 means a trim, which goes down to small pages
+ * even in huge page mode. The contents of the pages are gone, but the
+ * range stays mapped and reads as zero once touched again. MADV_FREE
+ * would be cheaper, but the pages keep counting against RSS until the
+ * kernel is short of memory, which is what this is meant to fix. Returns
+ * the bytes dropped.
+ */
+size_t heap_purge_span(char *start, char *end, size_t min)
+{
+    static size_t small_page;
+    size_t page;
+    char *first;
+    char *last;
+    if (!small_page) {
+        small_page = sysconf(_SC_PAGESIZE);
+    }
+    page = huge_mode && min ? HEAP_HUGE_SIZE : small_page;
+    first = (char *) (((uintptr_t) start + page - 1) & ~(uintptr_t) (page - 1));
+    last = (char *) ((uintptr_t) end & ~(uintptr_t) (page - 1));
+    if (last <= first || (size_t) (last - first) < min
+            || madvise(first, last - first, MADV_DONTNEED)) {
+        return 0;
+    }
+    return last - first;
+}
@@ -0,0 +1,293 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Replays an allocation trace recorded with MYMALLOC_TRACE against any of
+ * the backends, single threaded and in timestamp order, so two backends
+ * can be compared on exactly the same sequence of calls:
+ *
+ *     MYMALLOC_TRACE=/tmp/app.trace ./app
+ *     ./replay -a tlsf /tmp/app.trace
+ *
+ * Pointers in the trace, qualified by the process that recorded them,
+ * only serve as ids; the replay keeps its own mapping from them to the
+ * blocks it got. All of the replay's own memory
+ * comes straight from mmap so it doesn't show up in the heap numbers. The
+ * result is one line of JSON like bench prints.
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "my_malloc.h"
+#include "trace.h"
+
+struct live_block {
+    uint64_t id;
+    uint32_t process;
+    void *ptr;
+    size_t size;
+};
+
+static struct trace_event *events;
+static uint64_t *order;
+static struct live_block *table;
+static uint64_t table_mask;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *map_anon(size_t size)
+{
+    void *ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED) {
+        perror("replay: mmap");
+        exit(1);
+    }
+    return ret;
+}
+
+/* Events sort by time, then by position in the file, which keeps each
+ * thread's events in the order they were written.
+ */
+static int event_before(uint64_t a, uint64_t b)
+{
+    if (events[a].time != events[b].time) {
+        return events[a].time < events[b].time;
+    }
+    return a < b;
+}
+
+/* Heapsort, qsort would allocate.
+ */
+static void sift_down(uint64_t *a, uint64_t root, uint64_t n)
+{
+    uint64_t child, tmp;
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && event_before(a[child], a[child + 1])) {
+            child++;
+        }
+        if (!event_before(a[root], a[child])) {
+            return;
+        }
+        tmp = a[root];
+        a[root] = a[child];
+        a[child] = tmp;
+        root = child;
+    }
+}
+
+static void sort_events(uint64_t *a, uint64_t n)
+{
+    uint64_t i, tmp;
+    for (i = n / 2; i-- > 0;) {
+        sift_down(a, i, n);
+    }
+    for (i = n; i-- > 1;) {
+        tmp = a[0];
+        a[0] = a[i];
+        a[i] = tmp;
+        sift_down(a, 0, i);
+    }
+}
+
+static uint64_t hash(uint64_t id, uint32_t process)
+{
+    id ^= (uint64_t) process << 32;
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return id;
+}
+
+/* Open addressing with linear probing; id 0 marks an empty slot, which is
+ * fine since NULL is never a live block.
+ */
+static struct live_block *lookup(uint64_t id, uint32_t process)
+{
+    uint64_t i = hash(id, process) & table_mask;
+    while (table[i].id && (table[i].id != id || table[i].process != process)) {
+        i = (i + 1) & table_mask;
+    }
+    return &table[i];
+}
+
+/* Backward shift deletion, so lookups never need tombstones.
+ */
+static void remove_block(struct live_block *b)
+{
+    uint64_t i = b - table;
+    uint64_t j = i;
+    uint64_t home;
+    for (;;) {
+        table[i].id = 0;
+        do {
+            j = (j + 1) & table_mask;
+            if (!table[j].id) {
+                return;
+            }
+            home = hash(table[j].id, table[j].process) & table_mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: replay [-a algo] trace\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *algo = NULL;
+    struct trace_file tf;
+    struct trace_event *ev;
+    struct live_block *b;
+    uint64_t n = 0, i, unmatched = 0, start, elapsed = 0;
+    long live = 0, peak_live = 0;
+    size_t mapped, peak_mapped = 0;
+    void *p;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:")) != -1) {
+        switch (opt) {
+        case 'a':
+            algo = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    /* Has to come before anything that might allocate.
+     */
+    if (algo && malloc_set_algo(algo)) {
+        fprintf(stderr, "replay: can't use algo %s\n", algo);
+        return 2;
+    }
+    if (trace_map(argv[optind], &tf)) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "replay: %s: not a trace\n", argv[optind]);
+        } else if (errno == EPROTO) {
+            fprintf(stderr, "replay: %s: not a version %d trace\n", argv[optind], TRACE_VERSION);
+        } else {
+            perror(argv[optind]);
+        }
+        return 1;
+    }
+    events = tf.events;
+    order = map_anon(tf.nslots * sizeof(*order) + 1);
+    for (i = 0; i < tf.nslots; i++) {
+        if (events[i].op != TRACE_NONE) {
+            order[n++] = i;
+        }
+    }
+    sort_events(order, n);
+    for (table_mask = 1; table_mask < 2 * n; table_mask <<= 1) {
+    }
+    table = map_anon(table_mask * sizeof(*table));
+    table_mask--;
+
+    for (i = 0; i < n; i++) {
+        ev = &events[order[i]];
+        p = NULL;
+        switch (ev->op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_MEMALIGN:
+            if (!ev->ptr) {
+                continue;
+            }
+            start = now();
+            if (ev->op == TRACE_MALLOC) {
+                p = malloc(ev->size);
+            } else if (ev->op == TRACE_CALLOC) {
+                p = calloc(1, ev->size);
+            } else {
+                p = memalign(ev->arg, ev->size);
+            }
+            elapsed += now() - start;
+            break;
+        case TRACE_FREE:
+            b = lookup(ev->ptr, ev->process);
+            if (!b->id) {
+                unmatched++;
+                continue;
+            }
+            start = now();
+            free(b->ptr);
+            elapsed += now() - start;
+            live -= b->size;
+            remove_block(b);
+            continue;
+        case TRACE_REALLOC:
+            /* A failed realloc left the old block alone.
+             */
+            if (!ev->ptr && ev->size) {
+                continue;
+            }
+            b = ev->arg ? lookup(ev->arg, ev->process) : NULL;
+            if (ev->arg && !b->id) {
+                unmatched++;
+            }
+            start = now();
+            p = realloc(b && b->id ? b->ptr : NULL, ev->size);
+            elapsed += now() - start;
+            if (b && b->id) {
+                live -= b->size;
+                remove_block(b);
+            }
+            if (!ev->ptr) {
+                continue;
+            }
+            break;
+        default:
+            continue;
+        }
+        if (!p) {
+            fprintf(stderr, "replay: out of memory at event %llu\n", (unsigned long long) i);
+            return 1;
+        }
+        /* The id is still live if the trace lost its free, or another
+         * thread reused the address before our timestamp was taken.
+         */
+        b = lookup(ev->ptr, ev->process);
+        if (b->id) {
+            free(b->ptr);
+            live -= b->size;
+        }
+        b->id = ev->ptr;
+        b->process = ev->process;
+        b->ptr = p;
+        b->size = ev->size;
+        live += ev->size;
+        if (live > peak_live) {
+            peak_live = live;
+        }
+        mapped = malloc_mapped_bytes();
+        if (mapped > peak_mapped) {
+            peak_mapped = mapped;
+        }
+    }
+    printf("{\"algo\":\"%s\",\"trace\":\"%s\",\"events\":%llu,\"unmatched\":%llu,"
+            "\"seconds\":%.6f,\"peak_mapped\":%zu,\"peak_live\":%ld,\"fragmentation\":%.4f}\n",
+            malloc_algo_name(), argv[optind], (unsigned long long) n,
+            (unsigned long long) unmatched, elapsed / 1e9, peak_mapped, peak_live,
+            peak_mapped ? 1 - (double) peak_live / peak_mapped : 0);
+    return 0;
+}
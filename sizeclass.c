@@ -0,0 +1,214 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Works out slab size classes for a workload from traces recorded with
+ * MYMALLOC_TRACE, and writes them out as a header slab_malloc.c can be
+ * built with in place of its own tables:
+ *
+ *     MYMALLOC_TRACE=/tmp/app.trace ./app
+ *     ./sizeclass /tmp/app.trace > app_classes.h
+ *     make SLAB_CLASSES=app_classes.h
+ *
+ * Every small request in the traces counts, whatever the call. The
+ * classes are the ones that waste the fewest bytes per request, counting
+ * both the rounding up to a class and each slot's share of the space a
+ * slab page can't be divided into. Classes have to be multiples of 16
+ * for alignment, and the largest has to be SLAB_MAX_SIZE so that every
+ * small request has one.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+/* As in slab_malloc.c. The header size only feeds the cost estimate,
+ * the tables written out work the slot counts out from the real one.
+ */
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_HEADER_SIZE 64
+#define SLAB_MAX_SIZE 256
+#define GRANULES (SLAB_MAX_SIZE / 16)
+
+/* The classes slab_malloc.c has without a header, for comparison.
+ */
+static const unsigned int default_classes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+static uint64_t counts[SLAB_MAX_SIZE + 1];
+
+/* Bytes wasted by the requests from lo + 1 up to hi bytes, all served
+ * from hi byte slots.
+ */
+static double range_cost(unsigned int lo, unsigned int hi)
+{
+    unsigned int slots = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / hi;
+    double tail = (double) ((SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) % hi) / slots;
+    double ret = 0;
+    unsigned int sz;
+    for (sz = lo ? lo + 1 : 0; sz <= hi; sz++) {
+        ret += counts[sz] * (hi - sz + tail);
+    }
+    return ret;
+}
+
+static double classes_cost(const unsigned int *classes, unsigned int n)
+{
+    double ret = 0;
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        ret += range_cost(i ? classes[i - 1] : 0, classes[i]);
+    }
+    return ret;
+}
+
+/* Add up the small requests in one trace.
+ */
+static uint64_t read_trace(const char *path)
+{
+    struct trace_file tf;
+    struct trace_event *ev;
+    uint64_t i, n = 0;
+    if (trace_map(path, &tf)) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "sizeclass: %s: not a trace\n", path);
+        } else if (errno == EPROTO) {
+            fprintf(stderr, "sizeclass: %s: not a version %d trace\n", path, TRACE_VERSION);
+        } else {
+            perror(path);
+        }
+        exit(1);
+    }
+    for (i = 0; i < tf.nslots; i++) {
+        ev = &tf.events[i];
+        switch (ev->op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_REALLOC:
+        case TRACE_MEMALIGN:
+            if (ev->ptr && ev->size <= SLAB_MAX_SIZE) {
+                counts[ev->size]++;
+                n++;
+            }
+            break;
+        }
+    }
+    trace_unmap(&tf);
+    return n;
+}
+
+/* best[j][g] is the least waste for the requests up to 16 * g bytes with
+ * j classes, the largest of them 16 * g. Ties go to fewer classes, since
+ * every class keeps partly used pages of its own.
+ */
+static unsigned int choose_classes(unsigned int max, unsigned int *classes)
+{
+    static double best[GRANULES + 1][GRANULES + 1];
+    static unsigned int from[GRANULES + 1][GRANULES + 1];
+    double cost;
+    unsigned int j, g, p, n = 1;
+    for (g = 1; g <= GRANULES; g++) {
+        best[1][g] = range_cost(0, 16 * g);
+    }
+    for (j = 2; j <= max; j++) {
+        for (g = j; g <= GRANULES; g++) {
+            best[j][g] = -1;
+            for (p = j - 1; p < g; p++) {
+                cost = best[j - 1][p] + range_cost(16 * p, 16 * g);
+                if (best[j][g] < 0 || cost < best[j][g]) {
+                    best[j][g] = cost;
+                    from[j][g] = p;
+                }
+            }
+        }
+        if (best[j][GRANULES] < best[n][GRANULES]) {
+            n = j;
+        }
+    }
+    for (j = n, g = GRANULES; j > 0; j--) {
+        classes[j - 1] = 16 * g;
+        g = from[j][g];
+    }
+    return n;
+}
+
+static void write_header(const unsigned int *classes, unsigned int n, int argc, char *argv[])
+{
+    unsigned int sz, cls;
+    int i;
+    printf("/* Slab size classes generated by sizeclass from");
+    for (i = 0; i < argc; i++) {
+        printf(" %s", argv[i]);
+    }
+    printf(".\n * Build with make SLAB_CLASSES=<this file>.\n */\n");
+    printf("static const unsigned short slab_class_size[] = {\n   ");
+    for (cls = 0; cls < n; cls++) {
+        printf(" %u,", classes[cls]);
+    }
+    printf("\n};\n\n");
+    printf("static const unsigned char slab_class_index[SLAB_MAX_SIZE / 16 + 1] = {\n   ");
+    for (cls = 0, sz = 0; sz <= SLAB_MAX_SIZE; sz += 16) {
+        while (classes[cls] < sz) {
+            cls++;
+        }
+        printf(" %u,", cls);
+    }
+    printf("\n};\n\n");
+    printf("static const unsigned short slab_class_slots[] = {\n");
+    for (cls = 0; cls < n; cls++) {
+        printf("    (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / %u,\n", classes[cls]);
+    }
+    printf("};\n");
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: sizeclass [-n classes] trace...\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int classes[GRANULES];
+    unsigned int max = sizeof(default_classes) / sizeof(default_classes[0]);
+    unsigned int n;
+    uint64_t total = 0;
+    int opt, i;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max = atoi(optarg);
+            if (max < 1 || max > GRANULES) {
+                fprintf(stderr, "sizeclass: between 1 and %d classes\n", GRANULES);
+                return 2;
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc) {
+        usage();
+    }
+    for (i = optind; i < argc; i++) {
+        total += read_trace(argv[i]);
+    }
+    if (!total) {
+        fprintf(stderr, "sizeclass: no requests of up to %d bytes\n", SLAB_MAX_SIZE);
+        return 1;
+    }
+    n = choose_classes(max, classes);
+    write_header(classes, n, argc - optind, argv + optind);
+    fprintf(stderr, "sizeclass: %llu requests, %u classes waste %.2f bytes each (default %.2f)\n",
+            (unsigned long long) total, n, classes_cost(classes, n) / total,
+            classes_cost(default_classes, sizeof(default_classes) / sizeof(default_classes[0])) / total);
+    return 0;
+}
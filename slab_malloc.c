@@ -0,0 +1,554 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Size-class slab allocator. The heap is cut into SLAB_PAGE_SIZE pages.
+ * A page handed to a size class is split into equal slots and a bitmap
+ * in the page header says which ones are free, so small objects carry no
+ * header of their own and a pointer finds its page by masking off the low
+ * bits. Anything bigger than the largest class gets a run of whole pages.
+ * Only free runs are ever purged, aging the same way as blocks do in
+ * fat_malloc.c; a slab with a single slot in use keeps its page.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "heap.h"
+#include "my_malloc.h"
+
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_PAGE(ptr) ((struct slab_page *) ((uintptr_t) (ptr) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1)))
+#define SLAB_HEADER_SIZE ((sizeof(struct slab_page) + 15) & ~(size_t) 15)
+#define SLAB_SLOTS(page) ((char *) (page) + SLAB_HEADER_SIZE)
+#define SLAB_BITMAP_WORDS 4
+#define SLAB_CLASSES (sizeof(slab_class_size) / sizeof(slab_class_size[0]))
+#define SLAB_MAX_SIZE 256
+/* Past this the page count of a large allocation would wrap.
+ */
+#define SLAB_MAX_LARGE (SIZE_MAX >> 2)
+/* Pseudo classes for pages that aren't carved into slots.
+ */
+#define SLAB_LARGE 0xfffe
+#define SLAB_FREE 0xffff
+#define SLAB_AGED 0x1
+#define SLAB_PURGED 0x2
+
+struct slab_page {
+    struct slab_page *next;
+    struct slab_page *prev;
+    unsigned short cls;
+    unsigned short nfree;
+    /* Decay flags of a SLAB_FREE run.
+     */
+    unsigned short flags;
+    /* Length of the run for SLAB_LARGE and SLAB_FREE pages.
+     */
+    unsigned int npages;
+    /* Set bits are free slots.
+     */
+    uint64_t free_slots[SLAB_BITMAP_WORDS];
+};
+
+/* slab_class_index[(sz + 15) >> 4] is the smallest class holding sz
+ * bytes. A build for a particular workload can bring its own tables,
+ * worked out from a trace of it by sizeclass.c.
+ */
+#ifdef SLAB_CLASSES_FILE
+#include SLAB_CLASSES_FILE
+#else
+static const unsigned short slab_class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+static unsigned char slab_class_index[SLAB_MAX_SIZE / 16 + 1];
+
+static unsigned short slab_class_slots[SLAB_CLASSES];
+#endif
+
+/* Free structures of one arena.
+ */
+struct slab_heap {
+    /* Pages with at least one free slot, per class.
+     */
+    struct slab_page *partial[SLAB_CLASSES];
+    /* Address-ordered runs of unused pages.
+     */
+    struct slab_page *free_runs;
+};
+
+/* Small-object arenas are always slab, so this covers them too.
+ */
+static struct slab_heap slab_heaps[HEAP_ARENA_SLOTS];
+
+static void list_push(struct slab_page **head, struct slab_page *page)
+{
+    page->prev = NULL;
+    page->next = *head;
+    if (*head) {
+        (*head)->prev = page;
+    }
+    *head = page;
+}
+
+static void list_remove(struct slab_page **head, struct slab_page *page)
+{
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        *head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+}
+
+static struct slab_page *page_at(struct slab_page *page, size_t n)
+{
+    return (struct slab_page *) ((char *) page + n * SLAB_PAGE_SIZE);
+}
+
+/* Carve the first npages pages off a free run.
+ */
+static struct slab_page *take_pages(struct slab_heap *h, struct slab_page *run, size_t npages)
+{
+    struct slab_page *rest;
+    if (run->npages > npages) {
+        rest = page_at(run, npages);
+        rest->cls = SLAB_FREE;
+        rest->flags = run->flags;
+        rest->npages = run->npages - npages;
+        rest->prev = run->prev;
+        rest->next = run->next;
+        if (rest->prev) {
+            rest->prev->next = rest;
+        } else {
+            h->free_runs = rest;
+        }
+        if (rest->next) {
+            rest->next->prev = rest;
+        }
+    } else {
+        list_remove(&h->free_runs, run);
+    }
+    run->npages = npages;
+    return run;
+}
+
+/* First fit over the free runs.
+ */
+static struct slab_page *alloc_pages(struct slab_heap *h, size_t npages)
+{
+    struct slab_page *run = h->free_runs;
+    while (run && run->npages < npages) {
+        run = run->next;
+    }
+    if (!run) {
+        return NULL;
+    }
+    return take_pages(h, run, npages);
+}
+
+/* One run's part in a purge, see struct alloc_algo. The header page
+ * stays.
+ */
+static size_t purge_run(struct slab_page *run, int all)
+{
+    size_t ret;
+    if (run->flags & SLAB_PURGED) {
+        return 0;
+    }
+    if (!all && !(run->flags & SLAB_AGED)) {
+        run->flags |= SLAB_AGED;
+        return 0;
+    }
+    ret = heap_purge_span(SLAB_SLOTS(run), (char *) page_at(run, run->npages),
+            all ? 0 : HEAP_PURGE_MIN);
+    if (ret) {
+        run->flags |= SLAB_PURGED;
+    }
+    return ret;
+}
+
+/* Aged neighbouring runs are purged as they merge, see purge in heap.h.
+ */
+static void free_pages(struct slab_heap *h, struct slab_page *run)
+{
+    struct slab_page *last = NULL;
+    struct slab_page *tmp = h->free_runs;
+    while (tmp && tmp < run) {
+        last = tmp;
+        tmp = tmp->next;
+    }
+    run->cls = SLAB_FREE;
+    run->flags = 0;
+    run->prev = last;
+    run->next = tmp;
+    if (last) {
+        last->next = run;
+    } else {
+        h->free_runs = run;
+    }
+    if (tmp) {
+        tmp->prev = run;
+    }
+    if (tmp && page_at(run, run->npages) == tmp) {
+        purge_run(tmp, 0);
+        run->npages += tmp->npages;
+        list_remove(&h->free_runs, tmp);
+    }
+    if (last && page_at(last, last->npages) == run) {
+        purge_run(last, 0);
+        last->flags = 0;
+        last->npages += run->npages;
+        list_remove(&h->free_runs, run);
+    }
+}
+
+static struct slab_page *new_slab(struct slab_heap *h, unsigned int cls)
+{
+    struct slab_page *page = alloc_pages(h, 1);
+    unsigned int slots = slab_class_slots[cls];
+    unsigned int i;
+    if (!page) {
+        return NULL;
+    }
+    page->cls = cls;
+    page->nfree = slots;
+    for (i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        if (slots >= 64) {
+            page->free_slots[i] = ~(uint64_t) 0;
+            slots -= 64;
+        } else {
+            page->free_slots[i] = slots ? (((uint64_t) 1 << slots) - 1) : 0;
+            slots = 0;
+        }
+    }
+    list_push(&h->partial[cls], page);
+    return page;
+}
+
+int slab_add_region(struct heap_info *info, char *base, size_t size)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    char *start = (char *) (((uintptr_t) base + SLAB_PAGE_SIZE - 1) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+    struct slab_page *run = (struct slab_page *) start;
+    if (base + size < start + SLAB_PAGE_SIZE) {
+        return -1;
+    }
+    run->npages = (base + size - start) / SLAB_PAGE_SIZE;
+    free_pages(h, run);
+    return 0;
+}
+
+void slab_init_heap(struct heap_info *info)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    unsigned int cls;
+#ifndef SLAB_CLASSES_FILE
+    size_t sz;
+    /* The class tables are shared, and arenas are set up one at a time.
+     */
+    if (!slab_class_slots[0]) {
+        for (cls = 0, sz = 0; sz <= SLAB_MAX_SIZE; sz += 16) {
+            while (slab_class_size[cls] < sz) {
+                cls++;
+            }
+            slab_class_index[sz >> 4] = cls;
+        }
+        for (cls = 0; cls < SLAB_CLASSES; cls++) {
+            slab_class_slots[cls] = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / slab_class_size[cls];
+        }
+    }
+#endif
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        h->partial[cls] = NULL;
+    }
+    h->free_runs = NULL;
+    slab_add_region(info, info->heap, info->size);
+}
+
+void *slab_malloc(struct heap_info *info, size_t sz)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page;
+    unsigned int cls;
+    unsigned int i;
+    int bit;
+    if (sz > SLAB_MAX_SIZE) {
+        if (sz > SLAB_MAX_LARGE) {
+            return NULL;
+        }
+        page = alloc_pages(h, (sz + SLAB_HEADER_SIZE + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE);
+        if (!page) {
+            return NULL;
+        }
+        page->cls = SLAB_LARGE;
+        return SLAB_SLOTS(page);
+    }
+    cls = slab_class_index[(sz + 15) >> 4];
+    page = h->partial[cls];
+    if (!page && !(page = new_slab(h, cls))) {
+        return NULL;
+    }
+    for (i = 0; !page->free_slots[i]; i++)
+        ;
+    bit = __builtin_ctzll(page->free_slots[i]);
+    page->free_slots[i] &= page->free_slots[i] - 1;
+    if (!--page->nfree) {
+        list_remove(&h->partial[cls], page);
+    }
+    return SLAB_SLOTS(page) + (i * 64 + bit) * slab_class_size[cls];
+}
+
+void slab_free(struct heap_info *info, void *ptr)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page = SLAB_PAGE(ptr);
+    unsigned int slot;
+    if (page->cls == SLAB_LARGE) {
+        free_pages(h, page);
+        return;
+    }
+    slot = ((char *) ptr - SLAB_SLOTS(page)) / slab_class_size[page->cls];
+    page->free_slots[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    if (!page->nfree++) {
+        list_push(&h->partial[page->cls], page);
+    }
+    /* Hand an empty page back unless it is the only one the class has
+     * left, so a single alloc/free pair doesn't keep re-carving it.
+     */
+    if (page->nfree == slab_class_slots[page->cls]
+            && (page->prev || page->next)) {
+        list_remove(&h->partial[page->cls], page);
+        page->npages = 1;
+        free_pages(h, page);
+    }
+}
+
+/* Each page is emptied of free slots in one go before moving on to the
+ * next, instead of going back through the partial list for every slot.
+ */
+size_t slab_malloc_batch(struct heap_info *info, size_t sz, size_t n, void **ptrs)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page;
+    size_t got = 0;
+    unsigned int cls;
+    unsigned int i;
+    int bit;
+    if (sz > SLAB_MAX_SIZE) {
+        while (got < n && (ptrs[got] = slab_malloc(info, sz))) {
+            got++;
+        }
+        return got;
+    }
+    cls = slab_class_index[(sz + 15) >> 4];
+    while (got < n) {
+        page = h->partial[cls];
+        if (!page && !(page = new_slab(h, cls))) {
+            break;
+        }
+        for (i = 0; i < SLAB_BITMAP_WORDS && got < n; i++) {
+            while (page->free_slots[i] && got < n) {
+                bit = __builtin_ctzll(page->free_slots[i]);
+                page->free_slots[i] &= page->free_slots[i] - 1;
+                page->nfree--;
+                ptrs[got++] = SLAB_SLOTS(page) + (i * 64 + bit) * slab_class_size[cls];
+            }
+        }
+        if (!page->nfree) {
+            list_remove(&h->partial[cls], page);
+        }
+    }
+    return got;
+}
+
+/* Sorted, so the slots of a page all go back together.
+ */
+void slab_free_batch(struct heap_info *info, size_t n, void **ptrs)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        slab_free(info, ptrs[i]);
+    }
+}
+
+/* Pages a large allocation at ptr needs to hold sz bytes.
+ */
+static size_t large_pages(struct slab_page *page, void *ptr, size_t sz)
+{
+    return ((char *) ptr - (char *) page + sz + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+}
+
+int slab_resize(struct heap_info *info, void *ptr, size_t sz)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page = SLAB_PAGE(ptr);
+    struct slab_page *run = h->free_runs;
+    struct slab_page *end;
+    size_t npages;
+    if (page->cls != SLAB_LARGE) {
+        return sz <= slab_class_size[page->cls];
+    }
+    if (sz > SLAB_MAX_LARGE) {
+        return 0;
+    }
+    npages = large_pages(page, ptr, sz);
+    end = page_at(page, page->npages);
+    if (npages < page->npages) {
+        end = page_at(page, npages);
+        end->npages = page->npages - npages;
+        page->npages = npages;
+        free_pages(h, end);
+        return 1;
+    }
+    if (npages > page->npages) {
+        while (run && run < end) {
+            run = run->next;
+        }
+        if (run != end || page->npages + run->npages < npages) {
+            return 0;
+        }
+        take_pages(h, run, npages - page->npages);
+        page->npages = npages;
+    }
+    return 1;
+}
+
+/* Slots are only 16 byte aligned, so anything stricter is a large
+ * allocation with its buffer pushed up to the alignment. The header has
+ * to stay in the first page, which caps align at half a page; past that
+ * the block gets a mapping of its own, which free recognises since it
+ * isn't in any region.
+ */
+void *slab_memalign(struct heap_info *info, size_t align, size_t sz)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page;
+    size_t offset = align > SLAB_HEADER_SIZE ? align : SLAB_HEADER_SIZE;
+    if (align <= 16) {
+        return slab_malloc(info, sz);
+    }
+    if (align > SLAB_PAGE_SIZE / 2) {
+        return direct_malloc(sz, align);
+    }
+    if (sz > SLAB_MAX_LARGE) {
+        return NULL;
+    }
+    page = alloc_pages(h, (offset + sz + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE);
+    if (!page) {
+        return NULL;
+    }
+    page->cls = SLAB_LARGE;
+    return (char *) page + offset;
+}
+
+size_t slab_usable_size(void *ptr)
+{
+    struct slab_page *page = SLAB_PAGE(ptr);
+    if (page->cls == SLAB_LARGE) {
+        return (char *) page_at(page, page->npages) - (char *) ptr;
+    }
+    return slab_class_size[page->cls];
+}
+
+void slab_print_free_list(struct heap_info *info)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page;
+    unsigned int cls;
+    unsigned int i;
+    int used;
+    printf("----------\n");
+    printf("Slabs:\n");
+    printf("----------\n");
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        for (page = h->partial[cls]; page; page = page->next) {
+            used = slab_class_slots[cls];
+            for (i = 0; i < SLAB_BITMAP_WORDS; i++) {
+                used -= __builtin_popcountll(page->free_slots[i]);
+            }
+            printf("class %d (%d bytes): page %p, %d/%d used\n",
+                    cls, slab_class_size[cls], page, used, slab_class_slots[cls]);
+        }
+    }
+    printf("----------\n");
+    printf("Free pages:\n");
+    printf("----------\n");
+    for (page = h->free_runs; page; page = page->next) {
+        printf("addr: %p\n", page);
+        printf("pages: %d\n", page->npages);
+        printf("\n");
+    }
+}
+
+size_t slab_purge(struct heap_info *info, int all)
+{
+    struct slab_page *run;
+    size_t ret = 0;
+    for (run = slab_heaps[info->arena].free_runs; run; run = run->next) {
+        ret += purge_run(run, all);
+    }
+    return ret;
+}
+
+#ifdef MALLOC_STATS
+/* Free slots count as blocks of their class size, free runs as what a
+ * large allocation could get out of them.
+ */
+void slab_stats(struct heap_info *info, struct malloc_stats *st)
+{
+    struct slab_heap *h = &slab_heaps[info->arena];
+    struct slab_page *page;
+    unsigned int cls;
+    unsigned int i;
+    size_t bytes;
+    int nfree;
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        for (page = h->partial[cls]; page; page = page->next) {
+            nfree = 0;
+            for (i = 0; i < SLAB_BITMAP_WORDS; i++) {
+                nfree += __builtin_popcountll(page->free_slots[i]);
+            }
+            st->free_bytes += (size_t) nfree * slab_class_size[cls];
+            st->free_blocks += nfree;
+            if (slab_class_size[cls] > st->largest_free) {
+                st->largest_free = slab_class_size[cls];
+            }
+        }
+    }
+    for (page = h->free_runs; page; page = page->next) {
+        bytes = (size_t) page->npages * SLAB_PAGE_SIZE - SLAB_HEADER_SIZE;
+        st->free_bytes += bytes;
+        st->free_blocks++;
+        if (bytes > st->largest_free) {
+            st->largest_free = bytes;
+        }
+    }
+}
+#endif
+
+struct alloc_algo slab_algo = {
+    .id = ALGO_SLAB,
+    /* Page headers sit in front of the slots.
+     */
+    .fresh_zero = 1,
+    .init = slab_init_heap,
+    .malloc = slab_malloc,
+    .free = slab_free,
+    .usable_size = slab_usable_size,
+    .resize = slab_resize,
+    .memalign = slab_memalign,
+    .malloc_batch = slab_malloc_batch,
+    .free_batch = slab_free_batch,
+    .add_region = slab_add_region,
+    .print_free_list = slab_print_free_list,
+    .purge = slab_purge,
+#ifdef MALLOC_STATS
+    .stats = slab_stats,
+#endif
+};
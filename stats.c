@@ -0,0 +1,256 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Allocation statistics, built with -DMALLOC_STATS. Every thread counts
+ * into its own block of counters, which readers add up, so the entry
+ * points never write to a shared cache line except to publish a change in
+ * bytes in use every STATS_FLUSH bytes, which is what the peak is kept
+ * from. Free space comes from the backend, which is the only one that
+ * knows its free structures.
+ */
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "heap.h"
+#include "my_malloc.h"
+
+#ifdef MALLOC_STATS
+
+#define STATS_FLUSH (64 * 1024)
+
+struct thread_stats {
+    struct thread_stats *next;
+    struct thread_stats *prev;
+    /* 0 until registered, -1 once the thread is gone.
+     */
+    int state;
+    /* Only ever written by the owning thread, read by anyone.
+     */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t alloc_bytes;
+    uint64_t free_bytes;
+    uint64_t requests[MALLOC_STATS_CLASSES];
+    /* Change in bytes in use not yet added to stats_in_use.
+     */
+    long pending;
+};
+
+static __thread struct thread_stats _stats;
+static struct thread_stats *stats_threads = NULL;
+/* Counts left behind by threads that have exited, and anything counted
+ * after their own block was retired. Updated atomically.
+ */
+static struct thread_stats stats_retired;
+static long stats_in_use = 0;
+static long stats_peak = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+#define STATS_ADD(ts, field, n) __atomic_store_n(&(ts)->field, (ts)->field + (n), __ATOMIC_RELAXED)
+
+static unsigned int request_class(size_t sz)
+{
+    unsigned int cls;
+    if (sz <= 16) {
+        return 0;
+    }
+    cls = 64 - __builtin_clzll(sz - 1) - 4;
+    return cls < MALLOC_STATS_CLASSES ? cls : MALLOC_STATS_CLASSES - 1;
+}
+
+static void publish(long delta)
+{
+    long now = __atomic_add_fetch(&stats_in_use, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&stats_peak, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&stats_peak, &peak, now, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void stats_thread_exit(void *arg)
+{
+    struct thread_stats *ts = arg;
+    unsigned int i;
+    pthread_mutex_lock(&stats_lock);
+    if (ts->prev) {
+        ts->prev->next = ts->next;
+    } else {
+        stats_threads = ts->next;
+    }
+    if (ts->next) {
+        ts->next->prev = ts->prev;
+    }
+    __atomic_add_fetch(&stats_retired.allocs, ts->allocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats_retired.frees, ts->frees, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats_retired.alloc_bytes, ts->alloc_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats_retired.free_bytes, ts->free_bytes, __ATOMIC_RELAXED);
+    for (i = 0; i < MALLOC_STATS_CLASSES; i++) {
+        __atomic_add_fetch(&stats_retired.requests[i], ts->requests[i], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    publish(ts->pending);
+    ts->state = -1;
+}
+
+static void stats_make_key()
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct thread_stats *stats_get()
+{
+    struct thread_stats *ts = &_stats;
+    if (ts->state) {
+        return ts->state > 0 ? ts : NULL;
+    }
+    ts->state = 1;
+    pthread_mutex_lock(&stats_lock);
+    ts->prev = NULL;
+    ts->next = stats_threads;
+    if (stats_threads) {
+        stats_threads->prev = ts;
+    }
+    stats_threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_once(&stats_key_once, stats_make_key);
+    pthread_setspecific(stats_key, ts);
+    return ts;
+}
+
+void stats_alloc(size_t request, size_t usable)
+{
+    struct thread_stats *ts = stats_get();
+    if (!ts) {
+        __atomic_add_fetch(&stats_retired.allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats_retired.alloc_bytes, usable, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats_retired.requests[request_class(request)], 1, __ATOMIC_RELAXED);
+        publish(usable);
+        return;
+    }
+    STATS_ADD(ts, allocs, 1);
+    STATS_ADD(ts, alloc_bytes, usable);
+    STATS_ADD(ts, requests[request_class(request)], 1);
+    if ((ts->pending += usable) > STATS_FLUSH) {
+        publish(ts->pending);
+        ts->pending = 0;
+    }
+}
+
+void stats_free(size_t usable)
+{
+    struct thread_stats *ts = stats_get();
+    if (!ts) {
+        __atomic_add_fetch(&stats_retired.frees, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats_retired.free_bytes, usable, __ATOMIC_RELAXED);
+        publish(-(long) usable);
+        return;
+    }
+    STATS_ADD(ts, frees, 1);
+    STATS_ADD(ts, free_bytes, usable);
+    if ((ts->pending -= usable) < -STATS_FLUSH) {
+        publish(ts->pending);
+        ts->pending = 0;
+    }
+}
+
+static void add_counts(struct malloc_stats *st, struct thread_stats *ts)
+{
+    unsigned int i;
+    st->in_use_blocks += __atomic_load_n(&ts->allocs, __ATOMIC_RELAXED)
+        - __atomic_load_n(&ts->frees, __ATOMIC_RELAXED);
+    st->in_use_bytes += __atomic_load_n(&ts->alloc_bytes, __ATOMIC_RELAXED)
+        - __atomic_load_n(&ts->free_bytes, __ATOMIC_RELAXED);
+    for (i = 0; i < MALLOC_STATS_CLASSES; i++) {
+        st->requests[i] += __atomic_load_n(&ts->requests[i], __ATOMIC_RELAXED);
+    }
+}
+
+int malloc_get_stats(struct malloc_stats *st)
+{
+    struct heap_info *info;
+    struct thread_stats *ts;
+    size_t peak;
+    unsigned int i;
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&stats_lock);
+    add_counts(st, &stats_retired);
+    for (ts = stats_threads; ts; ts = ts->next) {
+        add_counts(st, ts);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    peak = __atomic_load_n(&stats_peak, __ATOMIC_RELAXED);
+    st->peak_in_use_bytes = peak > st->in_use_bytes ? peak : st->in_use_bytes;
+    st->mapped_bytes = malloc_mapped_bytes();
+    for (i = 0; i < HEAP_ARENA_SLOTS; i++) {
+        if ((info = heap_get_arena(i))) {
+            pthread_mutex_lock(&info->lock);
+            info->algo->stats(info, st);
+            pthread_mutex_unlock(&info->lock);
+        }
+    }
+    return 0;
+}
+
+void malloc_stats()
+{
+    struct malloc_stats st;
+    unsigned int i;
+    malloc_get_stats(&st);
+    fprintf(stderr, "backend:        %s\n", malloc_algo_name());
+    fprintf(stderr, "mapped bytes:   %zu\n", st.mapped_bytes);
+    fprintf(stderr, "in use bytes:   %zu (peak %zu)\n", st.in_use_bytes, st.peak_in_use_bytes);
+    fprintf(stderr, "in use blocks:  %zu\n", st.in_use_blocks);
+    fprintf(stderr, "free bytes:     %zu in %zu blocks, largest %zu\n",
+            st.free_bytes, st.free_blocks, st.largest_free);
+    for (i = 0; i < MALLOC_STATS_CLASSES; i++) {
+        if (st.requests[i]) {
+            fprintf(stderr, "requests %s %-10zu %llu\n",
+                    i < MALLOC_STATS_CLASSES - 1 ? "<=" : "> ",
+                    (size_t) 16 << (i < MALLOC_STATS_CLASSES - 1 ? i : i - 1),
+                    (unsigned long long) st.requests[i]);
+        }
+    }
+}
+
+#else
+
+int malloc_get_stats(struct malloc_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    return -1;
+}
+
+void malloc_stats()
+{
+    fprintf(stderr, "malloc statistics not compiled in, build with -DMALLOC_STATS\n");
+}
+
+#endif
+
+/* The glibc view of the same numbers, for tools that already know how to
+ * ask for it. Heap regions are its arena, direct mappings its mmapped
+ * chunks.
+ */
+struct mallinfo2 mallinfo2()
+{
+    struct mallinfo2 mi;
+    struct malloc_stats st;
+    memset(&mi, 0, sizeof(mi));
+    malloc_get_stats(&st);
+    mi.hblkhd = direct_mapped_bytes();
+    mi.arena = malloc_mapped_bytes() - mi.hblkhd;
+    mi.ordblks = st.free_blocks;
+    mi.usmblks = st.peak_in_use_bytes;
+    mi.uordblks = st.in_use_bytes;
+    mi.fordblks = st.free_bytes;
+    return mi;
+}
@@ -0,0 +1,253 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Per-thread allocation cache. Small requests are served out of a
+ * bounded stack of blocks per size class, so the shared free structures
+ * of whatever alloc_algo is in use (and the lock guarding them) are only
+ * touched when a bin has to be refilled or flushed, and then in batches.
+ * A bin is refilled from and flushed to whatever arena the call it
+ * happens in was given, so one thread's cache serves its main arena and
+ * its small-object one alike.
+ */
+#include <pthread.h>
+#include "heap.h"
+
+#define TCACHE_CLASSES 16
+#define TCACHE_CLASS_SIZE(c) (((size_t) (c) + 1) << 4)
+#define TCACHE_MAX_SIZE TCACHE_CLASS_SIZE(TCACHE_CLASSES - 1)
+#define TCACHE_MAX_COUNT 64
+#define TCACHE_BATCH 16
+
+struct tcache_bin {
+    unsigned int count;
+    void *slots[TCACHE_MAX_COUNT];
+};
+
+struct tcache {
+    /* The first arena the thread used, for flushing at thread exit.
+     */
+    struct heap_info *info;
+    /* 0 until the thread exit hook is installed, -1 once the cache has
+     * been torn down (everything goes straight to the algo after that).
+     */
+    int state;
+    struct tcache_bin bins[TCACHE_CLASSES];
+};
+
+static __thread struct tcache _tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static int tcache_enabled = 1;
+
+/* Smallest class that can hold sz bytes.
+ */
+static unsigned int alloc_class(size_t sz)
+{
+    return sz ? (sz - 1) >> 4 : 0;
+}
+
+/* Largest class that a block of usable bytes can serve.
+ */
+static unsigned int free_class(size_t usable)
+{
+    return (usable >> 4) - 1;
+}
+
+static void *locked_malloc(struct heap_info *info, size_t sz, int *fresh)
+{
+    void *ret;
+    arena_lock(info);
+    ret = heap_alloc(info, sz, fresh);
+    arena_unlock(info);
+    return ret;
+}
+
+/* Blocks from other arenas go onto their remote free stacks.
+ */
+static void locked_free(struct heap_info *info, void *ptr)
+{
+    struct heap_info *owner = heap_owner(ptr);
+    if (owner != info) {
+        heap_remote_free(owner, ptr, ptr);
+        return;
+    }
+    arena_lock(info);
+    algo_free(info, ptr);
+    heap_decay(info);
+    arena_unlock(info);
+}
+
+static void tcache_refill(struct tcache *tc, struct heap_info *info, unsigned int cls)
+{
+    struct tcache_bin *bin = &tc->bins[cls];
+    void *ptr;
+    arena_lock(info);
+    while (bin->count < TCACHE_BATCH) {
+        ptr = heap_alloc(info, TCACHE_CLASS_SIZE(cls), NULL);
+        if (!ptr) {
+            break;
+        }
+        bin->slots[bin->count++] = ptr;
+    }
+    arena_unlock(info);
+}
+
+/* Hand the n oldest blocks of a bin back to the algo. A bin can hold
+ * blocks from any arena; runs of them from the same other arena are
+ * chained up and pushed onto its remote free stack in one go.
+ */
+static void tcache_flush(struct tcache *tc, struct heap_info *info, unsigned int cls, unsigned int n)
+{
+    struct tcache_bin *bin = &tc->bins[cls];
+    struct heap_info *owner;
+    struct heap_info *chain = NULL;
+    void *first = NULL;
+    void *last = NULL;
+    void *ptr;
+    unsigned int i;
+    if (n > bin->count) {
+        n = bin->count;
+    }
+    arena_lock(info);
+    for (i = 0; i < n; i++) {
+        ptr = bin->slots[i];
+        owner = heap_owner(ptr);
+        if (owner == info) {
+            algo_free(info, ptr);
+            continue;
+        }
+        if (owner != chain) {
+            if (chain) {
+                heap_remote_free(chain, first, last);
+            }
+            chain = owner;
+            first = ptr;
+        } else {
+            *(void **) last = ptr;
+        }
+        last = ptr;
+    }
+    heap_decay(info);
+    arena_unlock(info);
+    if (chain) {
+        heap_remote_free(chain, first, last);
+    }
+    for (i = n; i < bin->count; i++) {
+        bin->slots[i - n] = bin->slots[i];
+    }
+    bin->count -= n;
+}
+
+static void tcache_thread_exit(void *arg)
+{
+    struct tcache *tc = arg;
+    unsigned int i;
+    for (i = 0; i < TCACHE_CLASSES; i++) {
+        tcache_flush(tc, tc->info, i, tc->bins[i].count);
+    }
+    tc->state = -1;
+}
+
+static void tcache_make_key()
+{
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+static struct tcache *tcache_get(struct heap_info *info)
+{
+    struct tcache *tc = &_tcache;
+    if (tc->state) {
+        return tc->state > 0 ? tc : NULL;
+    }
+    if (!tcache_enabled) {
+        tc->state = -1;
+        return NULL;
+    }
+    tc->info = info;
+    tc->state = 1;
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, tc);
+    return tc;
+}
+
+/* Only takes effect for threads that haven't allocated yet, so it has to
+ * be called as the heap is set up.
+ */
+void tcache_disable()
+{
+    tcache_enabled = 0;
+}
+
+/* If fresh isn't NULL it is set to whether the memory is known to be
+ * zero, which only happens when it was carved from a region mapped just
+ * for it.
+ */
+void *tcache_malloc(struct heap_info *info, size_t sz, int *fresh)
+{
+    struct tcache *tc;
+    struct tcache_bin *bin;
+    unsigned int cls;
+    if (fresh) {
+        *fresh = 0;
+    }
+    if (sz > TCACHE_MAX_SIZE || !(tc = tcache_get(info))) {
+        return locked_malloc(info, sz, fresh);
+    }
+    cls = alloc_class(sz);
+    bin = &tc->bins[cls];
+    if (!bin->count) {
+        tcache_refill(tc, info, cls);
+        if (!bin->count) {
+            return NULL;
+        }
+    }
+    return bin->slots[--bin->count];
+}
+
+static void tcache_put(struct heap_info *info, unsigned int cls, void *ptr)
+{
+    struct tcache *tc;
+    struct tcache_bin *bin;
+    if (!(tc = tcache_get(info))) {
+        locked_free(info, ptr);
+        return;
+    }
+    bin = &tc->bins[cls];
+    if (bin->count == TCACHE_MAX_COUNT) {
+        tcache_flush(tc, info, cls, TCACHE_BATCH);
+    }
+    bin->slots[bin->count++] = ptr;
+}
+
+/* info has to be an arena of the same algo as the one ptr came from.
+ */
+void tcache_free(struct heap_info *info, void *ptr)
+{
+    size_t usable = algo_usable_size(info, ptr);
+    if (usable < TCACHE_CLASS_SIZE(0) || usable > TCACHE_MAX_SIZE) {
+        locked_free(info, ptr);
+        return;
+    }
+    tcache_put(info, free_class(usable), ptr);
+}
+
+/* For a caller that knows what size a plain (not aligned) block was
+ * asked for with. Every algo hands out multiples of 16 at least as big
+ * as the request, so the block can serve the class the size maps to and
+ * the block itself isn't looked at. Aligned blocks can be far bigger
+ * than their size, and go through tcache_free instead.
+ */
+void tcache_free_sized(struct heap_info *info, void *ptr, size_t sz)
+{
+    if (sz > TCACHE_MAX_SIZE) {
+        locked_free(info, ptr);
+        return;
+    }
+    tcache_put(info, alloc_class(sz), ptr);
+}
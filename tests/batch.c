@@ -0,0 +1,136 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* malloc_batch and free_batch from several threads, mixed with single
+ * mallocs and frees. Batches of all sizes are filled and checked, and
+ * some are handed to another thread to free, so blocks go back through
+ * the remote free stacks of arenas other than the freeing thread's.
+ */
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "my_malloc.h"
+
+#define BATCH_THREADS 4
+#define BATCH_MAX 700
+#define BATCH_ROUNDS 1500
+
+static void *handoff[BATCH_THREADS][BATCH_MAX];
+static size_t handoff_count[BATCH_THREADS];
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "batch: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static uint64_t rng(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void *worker(void *arg)
+{
+    uintptr_t id = (uintptr_t) arg;
+    uintptr_t other = (id + 1) % BATCH_THREADS;
+    uint64_t seed = 0x1234567 + id * 7919;
+    void *p[BATCH_MAX];
+    unsigned char *c;
+    void *single;
+    size_t sz;
+    size_t n;
+    size_t i;
+    size_t j;
+    int round;
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        n = rng(&seed) % BATCH_MAX + 1;
+        switch (rng(&seed) % 4) {
+        case 0:
+            sz = rng(&seed) % 64 + 1;
+            break;
+        case 1:
+            sz = rng(&seed) % 512 + 1;
+            break;
+        case 2:
+            sz = rng(&seed) % 8192 + 1;
+            break;
+        default:
+            sz = rng(&seed) % 300000 + 1;
+            n = n % 8 + 1;
+            break;
+        }
+        if (malloc_batch(sz, n, p) != n) {
+            fail("short batch", n, sz);
+        }
+        for (i = 0; i < n; i++) {
+            if (malloc_usable_size(p[i]) < sz) {
+                fail("usable size too small", malloc_usable_size(p[i]), sz);
+            }
+            memset(p[i], (int) (i & 0xff), sz);
+        }
+        if (!(single = malloc(sz))) {
+            fail("malloc", sz, 0);
+        }
+        memset(single, 0xee, sz);
+        for (i = 0; i < n; i++) {
+            c = p[i];
+            for (j = 0; j < sz; j += 61) {
+                if (c[j] != (i & 0xff)) {
+                    fail("corrupt block", i, j);
+                }
+            }
+            if (c[sz - 1] != (i & 0xff)) {
+                fail("corrupt block end", i, sz);
+            }
+        }
+        free(single);
+        if (rng(&seed) % 3 == 0) {
+            pthread_mutex_lock(&handoff_lock);
+            free_batch(handoff_count[other], handoff[other]);
+            handoff_count[other] = 0;
+            if (handoff_count[id] + n <= BATCH_MAX) {
+                memcpy(handoff[id] + handoff_count[id], p, n * sizeof(void *));
+                handoff_count[id] += n;
+                n = 0;
+            }
+            pthread_mutex_unlock(&handoff_lock);
+        }
+        /* NULLs are allowed in a batch.
+         */
+        if (n > 2) {
+            free(p[1]);
+            p[1] = NULL;
+        }
+        free_batch(n, p);
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[BATCH_THREADS];
+    uintptr_t i;
+    for (i = 0; i < BATCH_THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *) i);
+    }
+    for (i = 0; i < BATCH_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < BATCH_THREADS; i++) {
+        free_batch(handoff_count[i], handoff[i]);
+    }
+    return 0;
+}
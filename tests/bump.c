@@ -0,0 +1,146 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Bump arenas, in a build with -DMALLOC_STATS so the mallocs they make
+ * can be counted. Allocations have to be aligned and not overlap, a big
+ * one has to get a chunk of its own without ending the current one, a
+ * reset arena has to go through the same work again on its spare chunks
+ * without calling malloc, a chunk past 4 MiB has to go back on reset and
+ * destroy has to give back everything.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "my_malloc.h"
+
+#define BUMP_TEST_ALLOCS 20000
+#define BUMP_TEST_CHUNK (64 * 1024)
+
+static unsigned char *ptrs[BUMP_TEST_ALLOCS];
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "bump: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static size_t size_of(size_t i)
+{
+    return i * 37 % 700 + (i % 50 ? 0 : 30000);
+}
+
+/* Calls to malloc and friends so far, and the blocks they left.
+ */
+static uint64_t mallocs(size_t *blocks)
+{
+    struct malloc_stats st;
+    uint64_t n = 0;
+    unsigned int i;
+    if (malloc_get_stats(&st)) {
+        fail("not built with MALLOC_STATS", 0, 0);
+    }
+    for (i = 0; i < MALLOC_STATS_CLASSES; i++) {
+        n += st.requests[i];
+    }
+    if (blocks) {
+        *blocks = st.in_use_blocks;
+    }
+    return n;
+}
+
+/* A round of allocations that spans several chunks, every one aligned
+ * and filled, then checked once they are all there.
+ */
+static void fill(struct bump_arena *a)
+{
+    size_t i;
+    size_t j;
+    for (i = 0; i < BUMP_TEST_ALLOCS; i++) {
+        if (!(ptrs[i] = bump_arena_alloc(a, size_of(i)))) {
+            fail("bump_arena_alloc", i, size_of(i));
+        }
+        if ((uintptr_t) ptrs[i] % 16) {
+            fail("misaligned", i, (uintptr_t) ptrs[i] % 16);
+        }
+        memset(ptrs[i], (int) (i & 0xff), size_of(i));
+    }
+    for (i = 0; i < BUMP_TEST_ALLOCS; i++) {
+        for (j = 0; j < size_of(i); j++) {
+            if (ptrs[i][j] != (i & 0xff)) {
+                fail("overlapping allocations", i, j);
+            }
+        }
+    }
+}
+
+int main()
+{
+    struct bump_arena *a;
+    unsigned char *small;
+    unsigned char *big;
+    unsigned char *next;
+    uint64_t calls;
+    size_t blocks_before;
+    size_t blocks;
+    size_t mapped;
+    mallocs(&blocks_before);
+    if (!(a = bump_arena_create(BUMP_TEST_CHUNK))) {
+        fail("bump_arena_create", 0, 0);
+    }
+    /* A request that doesn't fit in what's left of the chunk and is
+     * more than a quarter of the next one gets a chunk of its own, and
+     * the current chunk carries on after it.
+     */
+    small = bump_arena_alloc(a, 16);
+    next = bump_arena_alloc(a, BUMP_TEST_CHUNK / 2);
+    big = bump_arena_alloc(a, BUMP_TEST_CHUNK * 3 / 4);
+    if (!small || !big || next != small + 16) {
+        fail("allocations not bumped", (size_t) (next - small), 16);
+    }
+    next = bump_arena_alloc(a, 16);
+    if (next != small + 16 + BUMP_TEST_CHUNK / 2) {
+        fail("big request ended the chunk", (size_t) (next - small), 16 + BUMP_TEST_CHUNK / 2);
+    }
+    if (big + BUMP_TEST_CHUNK * 3 / 4 > small && big < small + BUMP_TEST_CHUNK) {
+        fail("big request inside the chunk", 0, 0);
+    }
+    bump_arena_reset(a);
+    fill(a);
+    bump_arena_reset(a);
+    calls = mallocs(NULL);
+    fill(a);
+    if (mallocs(NULL) != calls) {
+        fail("mallocs after reset", mallocs(NULL) - calls, 0);
+    }
+    /* A chunk past BUMP_MAX_CHUNK is only for the request it was made
+     * for.
+     */
+    bump_arena_reset(a);
+    mallocs(&blocks);
+    if (!(big = bump_arena_alloc(a, 8 << 20))) {
+        fail("bump_arena_alloc", 8 << 20, 0);
+    }
+    memset(big, 0x33, 8 << 20);
+    mapped = malloc_mapped_bytes();
+    bump_arena_reset(a);
+    if (malloc_mapped_bytes() + (8 << 20) > mapped) {
+        fail("big chunk kept", mapped, malloc_mapped_bytes());
+    }
+    mallocs(&calls);
+    if (calls != blocks) {
+        fail("blocks after reset", calls, blocks);
+    }
+    bump_arena_destroy(a);
+    mallocs(&blocks);
+    if (blocks != blocks_before) {
+        fail("blocks left after destroy", blocks, blocks_before);
+    }
+    return 0;
+}
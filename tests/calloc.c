@@ -0,0 +1,102 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* calloc has to hand back zeroes however the block came about. Each
+ * round dirties a batch of blocks and frees them in an order that lets
+ * neighbours coalesce, then callocs blocks of all sizes while holding on
+ * to them, so the heap keeps growing and some of them are carved from
+ * regions mapped just for them. That is the path where calloc trusts the
+ * memory to be zero apart from the free structure the algo left in it.
+ * Several threads do it at once, so in ctree mode a new region can be
+ * used and freed by one thread before another carves from it.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALLOC_THREADS 4
+#define CALLOC_ROUNDS 30
+#define CALLOC_DIRTY 400
+#define CALLOC_HELD 600
+#define CALLOC_MAX_SIZE 20000
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "calloc: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static size_t next_size(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    if ((*seed >> 40) % 4 == 0) {
+        return (*seed >> 13) % CALLOC_MAX_SIZE + 1;
+    }
+    return (*seed >> 13) % 256 + 1;
+}
+
+static void *worker(void *arg)
+{
+    uint64_t seed = (uintptr_t) arg * 2654435761u + 1;
+    void *dirty[CALLOC_DIRTY];
+    unsigned char *held[CALLOC_HELD];
+    size_t sz;
+    size_t i;
+    size_t j;
+    int round;
+    for (round = 0; round < CALLOC_ROUNDS; round++) {
+        for (i = 0; i < CALLOC_DIRTY; i++) {
+            sz = next_size(&seed);
+            if (!(dirty[i] = malloc(sz))) {
+                fail("malloc", sz, 0);
+            }
+            memset(dirty[i], 0xa5, sz);
+        }
+        /* Every other one first, then the rest, which merge with both
+         * neighbours on the way out.
+         */
+        for (i = 0; i < CALLOC_DIRTY; i += 2) {
+            free(dirty[i]);
+        }
+        for (i = 1; i < CALLOC_DIRTY; i += 2) {
+            free(dirty[i]);
+        }
+        for (i = 0; i < CALLOC_HELD; i++) {
+            sz = next_size(&seed) * (round % 4 + 1);
+            if (!(held[i] = calloc(1, sz))) {
+                fail("calloc", sz, 0);
+            }
+            for (j = 0; j < sz; j++) {
+                if (held[i][j]) {
+                    fail("not zero", sz, j);
+                }
+            }
+            memset(held[i], 0x5a, sz);
+        }
+        for (i = 0; i < CALLOC_HELD; i++) {
+            free(held[i]);
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[CALLOC_THREADS];
+    int i;
+    for (i = 0; i < CALLOC_THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *) (uintptr_t) (i + 1));
+    }
+    for (i = 0; i < CALLOC_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
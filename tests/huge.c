@@ -0,0 +1,94 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Huge page regions. Re-executed with MYMALLOC_HUGEPAGES=thp and then
+ * hugetlb, it checks that the mappings holding heap blocks (none of them
+ * big enough for a mapping of its own) are whole 2 MiB pages on 2 MiB
+ * boundaries, and are either hugetlb mappings or madvised for
+ * transparent huge pages. Without reserved huge pages, which is the
+ * usual case, hugetlb mode only gets that far by falling back to THP.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HUGE_PAGE ((uintptr_t) 2 << 20)
+#define HUGE_TEST_SIZES 5
+
+static const size_t sizes[HUGE_TEST_SIZES] = { 16, 100, 4000, 30000, 100000 };
+
+static void fail(const char *what, uintptr_t a, uintptr_t b)
+{
+    fprintf(stderr, "huge: %s (%#lx, %#lx)\n", what, (unsigned long) a, (unsigned long) b);
+    abort();
+}
+
+/* Finds the mapping ptr is in, in /proc/self/smaps, and checks it. Lines
+ * that start with a capital are fields of the mapping above them.
+ */
+static void check(void *ptr)
+{
+    char line[512];
+    unsigned long start;
+    unsigned long end;
+    int found = 0;
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        fail("smaps", 0, 0);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if ((line[0] < 'A' || line[0] > 'Z') && sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            found = start <= (uintptr_t) ptr && (uintptr_t) ptr < end;
+            if (found && (start % HUGE_PAGE || end % HUGE_PAGE)) {
+                fail("mapping not in whole huge pages", start, end);
+            }
+            continue;
+        }
+        if (found && !strncmp(line, "VmFlags:", 8)) {
+            if (!strstr(line, " hg") && !strstr(line, " ht")) {
+                fail("mapping not for huge pages", start, end);
+            }
+            fclose(f);
+            return;
+        }
+    }
+    fail("no mapping holds", (uintptr_t) ptr, 0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = getenv("MYMALLOC_HUGEPAGES");
+    void *p[HUGE_TEST_SIZES];
+    int i;
+    if (!mode || (strcmp(mode, "thp") && strcmp(mode, "hugetlb"))) {
+        setenv("MYMALLOC_HUGEPAGES", "thp", 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    for (i = 0; i < HUGE_TEST_SIZES; i++) {
+        if (!(p[i] = malloc(sizes[i]))) {
+            fail("malloc", sizes[i], 0);
+        }
+        memset(p[i], 0x5a, sizes[i]);
+    }
+    for (i = 0; i < HUGE_TEST_SIZES; i++) {
+        check(p[i]);
+        free(p[i]);
+    }
+    if (!strcmp(mode, "thp")) {
+        setenv("MYMALLOC_HUGEPAGES", "hugetlb", 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    return 0;
+}
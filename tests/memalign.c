@@ -0,0 +1,81 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* posix_memalign at every alignment from 16 bytes up to twice HEAP_ALIGN,
+ * which is past what a block lines up to on its own in any of the
+ * backends, mixed with realloc of the aligned blocks and malloc_usable_size
+ * on them. Every block is written end to end so one that overlaps another
+ * shows up in the pattern check before it's freed.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMALIGN_BLOCKS 4000
+#define MEMALIGN_ROUNDS 10
+#define MEMALIGN_SHIFTS 18
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "memalign: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static void check(unsigned char *c, size_t n, int value)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (c[i] != value) {
+            fail("corrupt block", n, i);
+        }
+    }
+}
+
+int main()
+{
+    static unsigned char *p[MEMALIGN_BLOCKS];
+    static size_t sizes[MEMALIGN_BLOCKS];
+    void *ptr;
+    size_t align;
+    size_t i;
+    int round;
+    for (round = 0; round < MEMALIGN_ROUNDS; round++) {
+        for (i = 0; i < MEMALIGN_BLOCKS; i++) {
+            align = (size_t) 16 << ((i + round) % MEMALIGN_SHIFTS);
+            sizes[i] = (i * 7919 + round) % 5000 + 1;
+            if (posix_memalign(&ptr, align, sizes[i])) {
+                fail("posix_memalign", align, sizes[i]);
+            }
+            if ((uintptr_t) ptr & (align - 1)) {
+                fail("misaligned", align, (uintptr_t) ptr);
+            }
+            if (malloc_usable_size(ptr) < sizes[i]) {
+                fail("usable size too small", malloc_usable_size(ptr), sizes[i]);
+            }
+            p[i] = ptr;
+            memset(p[i], (int) (i & 0xff), sizes[i]);
+            if (i % 3 == 0) {
+                if (!(ptr = realloc(p[i], sizes[i] * 2))) {
+                    fail("realloc", sizes[i] * 2, 0);
+                }
+                check(ptr, sizes[i], (int) (i & 0xff));
+                p[i] = ptr;
+                sizes[i] *= 2;
+                memset(p[i], (int) (i & 0xff), sizes[i]);
+            }
+        }
+        for (i = 0; i < MEMALIGN_BLOCKS; i++) {
+            check(p[i], sizes[i], (int) (i & 0xff));
+            free(p[i]);
+        }
+    }
+    return 0;
+}
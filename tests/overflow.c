@@ -0,0 +1,63 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Requests too big for any heap have to fail cleanly rather than wrap
+ * around in some size calculation and come back as a tiny block. Run
+ * once as is and once more, re-executed, with MYMALLOC_MMAP_THRESHOLD
+ * set past what it can be, which used to keep such requests in the
+ * backends.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void expect_null(const char *what, void *ptr)
+{
+    if (ptr || errno != ENOMEM) {
+        fprintf(stderr, "overflow: %s gave %p, errno %d\n", what, ptr, errno);
+        abort();
+    }
+    errno = 0;
+}
+
+int main(int argc, char **argv)
+{
+    volatile size_t huge = SIZE_MAX;
+    void *ptr;
+    void *old;
+    if (!getenv("MYMALLOC_MMAP_THRESHOLD")) {
+        setenv("MYMALLOC_MMAP_THRESHOLD", "0xffffffffffffffff", 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    errno = 0;
+    expect_null("malloc", malloc(huge - 8));
+    expect_null("malloc of a quarter", malloc(huge / 4 + 1));
+    expect_null("calloc", calloc(2, huge / 2 + 1));
+    if (!(old = malloc(100))) {
+        return 1;
+    }
+    memset(old, 0x3c, 100);
+    expect_null("realloc", realloc(old, huge - 4));
+    if (((unsigned char *) old)[99] != 0x3c) {
+        fprintf(stderr, "overflow: failed realloc lost the block\n");
+        abort();
+    }
+    free(old);
+    if (posix_memalign(&ptr, 64, huge - 100) != ENOMEM) {
+        fprintf(stderr, "overflow: posix_memalign didn't fail\n");
+        abort();
+    }
+    expect_null("aligned_alloc", aligned_alloc(4096, huge & ~(size_t) 4095));
+    return 0;
+}
@@ -0,0 +1,167 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Persistent heaps. A list is built in a new heap, which is closed and
+ * opened again to follow it by offset. Then a child process adds to it
+ * and is killed with the heap open, in the middle of allocating and
+ * freeing other blocks: that heap has to be refused by pheap_open and
+ * taken by pheap_recover with the list intact, and what the recovered
+ * heap hands out must not overlap it.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#define PHEAP_SIZE (4 * 1024 * 1024)
+#define PHEAP_NODES 1000
+
+struct node {
+    size_t next;
+    size_t value;
+    char pad[40];
+};
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "pheap: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+/* Push values from to to onto the list at the root.
+ */
+static void add_nodes(struct pheap *ph, size_t from, size_t to)
+{
+    struct node *n;
+    size_t i;
+    for (i = from; i < to; i++) {
+        if (!(n = pheap_alloc(ph, sizeof(*n)))) {
+            fail("pheap_alloc", i, 0);
+        }
+        n->value = i;
+        memset(n->pad, (int) (i & 0xff), sizeof(n->pad));
+        n->next = pheap_offset(ph, pheap_root(ph));
+        pheap_set_root(ph, n);
+    }
+}
+
+/* The list has to hold count down to 0, in that order.
+ */
+static void check_nodes(struct pheap *ph, size_t count)
+{
+    struct node *n = pheap_root(ph);
+    size_t i = count;
+    size_t j;
+    for (; n; n = pheap_pointer(ph, n->next)) {
+        if (!i || n->value != --i) {
+            fail("list out of order", n->value, i);
+        }
+        for (j = 0; j < sizeof(n->pad); j++) {
+            if (n->pad[j] != (char) (i & 0xff)) {
+                fail("node overwritten", i, j);
+            }
+        }
+    }
+    if (i) {
+        fail("list cut short", i, count);
+    }
+}
+
+int main()
+{
+    char path[] = "/tmp/mymalloc-pheap-XXXXXX";
+    struct pheap *ph;
+    static void *blocks[PHEAP_NODES];
+    size_t i;
+    pid_t pid;
+    int ready[2];
+    int status;
+    char c;
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fail("mkstemp", 0, 0);
+    }
+    close(fd);
+    if (!(ph = pheap_open(path, PHEAP_SIZE))) {
+        fail("create", errno, 0);
+    }
+    add_nodes(ph, 0, PHEAP_NODES);
+    if (pheap_close(ph)) {
+        fail("close", errno, 0);
+    }
+    if (!(ph = pheap_open(path, 0))) {
+        fail("reopen", errno, 0);
+    }
+    check_nodes(ph, PHEAP_NODES);
+    if (pheap_close(ph)) {
+        fail("close", errno, 0);
+    }
+    if (pipe(ready)) {
+        fail("pipe", errno, 0);
+    }
+    if ((pid = fork()) < 0) {
+        fail("fork", errno, 0);
+    }
+    if (!pid) {
+        /* Grows the list, then churns other blocks until it is killed,
+         * most likely halfway through an alloc or a free.
+         */
+        if (!(ph = pheap_open(path, 0))) {
+            _exit(1);
+        }
+        add_nodes(ph, PHEAP_NODES, 2 * PHEAP_NODES);
+        if (write(ready[1], "", 1) != 1) {
+            _exit(1);
+        }
+        for (i = 0;; i++) {
+            pheap_free(ph, blocks[i % PHEAP_NODES]);
+            blocks[i % PHEAP_NODES] = pheap_alloc(ph, 16 + i * 7 % 3000);
+        }
+    }
+    if (read(ready[0], &c, 1) != 1) {
+        fail("child died", 0, 0);
+    }
+    usleep(20000);
+    kill(pid, SIGKILL);
+    if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status)) {
+        fail("child", status, 0);
+    }
+    if ((ph = pheap_open(path, 0)) || errno != EUCLEAN) {
+        fail("dirty heap opened", errno, 0);
+    }
+    if (!(ph = pheap_recover(path, 0))) {
+        fail("recover", errno, 0);
+    }
+    check_nodes(ph, 2 * PHEAP_NODES);
+    for (i = 0; i < PHEAP_NODES; i++) {
+        if (!(blocks[i] = pheap_alloc(ph, 48 + i % 200))) {
+            fail("pheap_alloc after recovery", i, 0);
+        }
+        memset(blocks[i], 0x5a, 48 + i % 200);
+    }
+    check_nodes(ph, 2 * PHEAP_NODES);
+    for (i = 0; i < PHEAP_NODES; i++) {
+        pheap_free(ph, blocks[i]);
+    }
+    if (pheap_close(ph)) {
+        fail("close", errno, 0);
+    }
+    if (!(ph = pheap_open(path, 0))) {
+        fail("open after recovery", errno, 0);
+    }
+    check_nodes(ph, 2 * PHEAP_NODES);
+    pheap_close(ph);
+    unlink(path);
+    return 0;
+}
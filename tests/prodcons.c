@@ -0,0 +1,140 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Producer and consumer threads in pairs: producers allocate and fill
+ * blocks and pass them over a ring, consumers check, sometimes realloc,
+ * and free them, so nearly every free is of a block from another
+ * thread's arena and goes through its remote free stack. The tree
+ * backends keep a mask per free list set of the orders that have free
+ * blocks; if a free on that path left a bit clear, the space behind it
+ * would never be found again and each round would map more. So the whole
+ * thing runs a few times over, and the heap mustn't keep growing.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "my_malloc.h"
+
+#define PRODCONS_PAIRS 4
+#define PRODCONS_RING 1024
+#define PRODCONS_ITEMS 100000
+#define PRODCONS_ROUNDS 4
+#define PRODCONS_KEEP 64
+
+struct ring {
+    void *slots[PRODCONS_RING];
+    size_t sizes[PRODCONS_RING];
+    unsigned int head;
+    unsigned int tail;
+};
+
+static struct ring rings[PRODCONS_PAIRS];
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "prodcons: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static void *producer(void *arg)
+{
+    struct ring *r = arg;
+    uint64_t seed = (uintptr_t) arg;
+    unsigned char *p;
+    size_t sz;
+    int i;
+    for (i = 0; i < PRODCONS_ITEMS; i++) {
+        seed = seed * 6364136223846793005ULL + 1;
+        sz = (seed >> 33) % ((seed >> 20) % 8 ? 256 : 5000) + 1;
+        if (!(p = malloc(sz))) {
+            fail("malloc", sz, 0);
+        }
+        memset(p, (int) (sz & 0xff), sz);
+        while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == PRODCONS_RING) {
+            sched_yield();
+        }
+        r->slots[r->head % PRODCONS_RING] = p;
+        r->sizes[r->head % PRODCONS_RING] = sz;
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct ring *r = arg;
+    void *keep[PRODCONS_KEEP];
+    unsigned char *p;
+    size_t sz;
+    size_t j;
+    int kept = 0;
+    int i;
+    int k;
+    for (i = 0; i < PRODCONS_ITEMS; i++) {
+        while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+            sched_yield();
+        }
+        p = r->slots[r->tail % PRODCONS_RING];
+        sz = r->sizes[r->tail % PRODCONS_RING];
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+        for (j = 0; j < sz; j++) {
+            if (p[j] != (sz & 0xff)) {
+                fail("corrupt block", sz, j);
+            }
+        }
+        if (i % 7 == 0 && !(p = realloc(p, sz * 2 + 1))) {
+            fail("realloc", sz * 2 + 1, 0);
+        }
+        free(p);
+        /* Some of the consumer's own, freed locally.
+         */
+        if (kept < PRODCONS_KEEP) {
+            if (!(keep[kept++] = malloc(i % 300 + 1))) {
+                fail("malloc", i % 300 + 1, 0);
+            }
+        } else {
+            for (k = 0; k < kept; k++) {
+                free(keep[k]);
+            }
+            kept = 0;
+        }
+    }
+    for (k = 0; k < kept; k++) {
+        free(keep[k]);
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[2 * PRODCONS_PAIRS];
+    size_t first = 0;
+    size_t mapped;
+    int round;
+    int i;
+    for (round = 0; round < PRODCONS_ROUNDS; round++) {
+        for (i = 0; i < PRODCONS_PAIRS; i++) {
+            pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+            pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+        }
+        for (i = 0; i < 2 * PRODCONS_PAIRS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        mapped = malloc_mapped_bytes();
+        if (!round) {
+            first = mapped;
+        } else if (mapped > 2 * first) {
+            fail("heap keeps growing", first, mapped);
+        }
+    }
+    return 0;
+}
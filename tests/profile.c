@@ -0,0 +1,105 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* The sampled heap profile, re-executed with MYMALLOC_PROFILE_RATE set.
+ * A block too big to miss keeps its sample through a realloc that fails,
+ * and threads that only ever make one small allocation mustn't all have
+ * it sampled.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#define THREADS 200
+
+static void fail(const char *what, unsigned long long a, unsigned long long b)
+{
+    fprintf(stderr, "profile: %s: %llu, %llu\n", what, a, b);
+    abort();
+}
+
+/* Live samples in the profile, from the header line of a dump.
+ */
+static unsigned long long live_samples()
+{
+    char path[] = "/tmp/mymalloc-profile-XXXXXX";
+    unsigned long long n;
+    FILE *f;
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fail("mkstemp", 0, 0);
+    }
+    close(fd);
+    if (malloc_profile_dump(path) || !(f = fopen(path, "r"))) {
+        fail("dump", 0, 0);
+    }
+    if (fscanf(f, "heap profile: %llu:", &n) != 1) {
+        fail("header", 0, 0);
+    }
+    fclose(f);
+    unlink(path);
+    return n;
+}
+
+static void *one_alloc(void *arg)
+{
+    return malloc(64);
+}
+
+int main(int argc, char **argv)
+{
+    volatile size_t huge = SIZE_MAX;
+    pthread_t threads[THREADS];
+    void *blocks[THREADS];
+    unsigned long long before;
+    unsigned long long after;
+    void *big;
+    int i;
+    if (!getenv("MYMALLOC_PROFILE_RATE")) {
+        setenv("MYMALLOC_PROFILE_RATE", "1048576", 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    /* 64 times the rate, so sampled all but never.
+     */
+    if (!(big = malloc(64 << 20))) {
+        return 1;
+    }
+    before = live_samples();
+    if (!before) {
+        fail("big block not sampled", before, 0);
+    }
+    if (realloc(big, huge - 4)) {
+        fail("huge realloc worked", 0, 0);
+    }
+    if ((after = live_samples()) != before) {
+        fail("failed realloc changed the samples", before, after);
+    }
+    free(big);
+    /* 200 blocks of 64 bytes come to about one in a thousand of being
+     * sampled.
+     */
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, one_alloc, NULL)) {
+            fail("pthread_create", i, 0);
+        }
+        pthread_join(threads[i], &blocks[i]);
+    }
+    if ((after = live_samples()) > THREADS / 10) {
+        fail("first allocations sampled", after, THREADS);
+    }
+    for (i = 0; i < THREADS; i++) {
+        free(blocks[i]);
+    }
+    return 0;
+}
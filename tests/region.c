@@ -0,0 +1,48 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* The region map, straight through heap.h. Heap blocks have to be found
+ * in their region, and addresses past the 48 bits it covers, which 5-level
+ * paging or a stray pointer can produce, in none.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "heap.h"
+
+static void fail(const char *what, uintptr_t a)
+{
+    fprintf(stderr, "region: %s (%#lx)\n", what, (unsigned long) a);
+    abort();
+}
+
+int main()
+{
+    static const uintptr_t outside[] = {
+        (uintptr_t) 1 << 48,
+        ((uintptr_t) 1 << 56) + 12345,
+        UINTPTR_MAX & ~(uintptr_t) 15,
+    };
+    char *p = malloc(100);
+    unsigned int i;
+    if (!p || !heap_owns(p) || !heap_owner(p)) {
+        fail("heap block not owned", (uintptr_t) p);
+    }
+    if (!heap_region_of(p) || heap_region_of(p) > p) {
+        fail("heap block not in a region", (uintptr_t) p);
+    }
+    for (i = 0; i < sizeof(outside) / sizeof(outside[0]); i++) {
+        if (heap_owns((void *) outside[i]) || heap_owner((void *) outside[i])
+                || heap_region_of((void *) outside[i])) {
+            fail("owns an address past the map", outside[i]);
+        }
+    }
+    free(p);
+    return 0;
+}
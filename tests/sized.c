@@ -0,0 +1,99 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* free_sized and free_aligned_sized. Blocks of every small size are
+ * freed with their size and handed out again, and their patterns checked
+ * on the way, so one filed under a class it can't serve shows up as a
+ * block that overlaps another. Then aligned blocks, including ones past
+ * HEAP_ALIGN that are a pointer into the middle of something much
+ * bigger, go back with free_aligned_sized and a small size, and the small
+ * mallocs after that must not be handed any of them.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "my_malloc.h"
+
+#define SIZED_BLOCKS 20000
+#define SIZED_ROUNDS 20
+#define SIZED_ALIGNED 64
+#define SIZED_SMALL 512
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "sized: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static void check(unsigned char *c, size_t n, int value)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (c[i] != value) {
+            fail("corrupt block", n, i);
+        }
+    }
+}
+
+int main()
+{
+    static unsigned char *p[SIZED_BLOCKS];
+    static size_t sizes[SIZED_BLOCKS];
+    void *aligned[SIZED_ALIGNED];
+    void *small[SIZED_SMALL];
+    size_t align;
+    size_t i;
+    int round;
+    for (round = 0; round < SIZED_ROUNDS; round++) {
+        for (i = 0; i < SIZED_BLOCKS; i++) {
+            sizes[i] = (i * 31 + round) % 600 + 1;
+            if (!(p[i] = malloc(sizes[i]))) {
+                fail("malloc", sizes[i], 0);
+            }
+            memset(p[i], (int) (i & 0xff), sizes[i]);
+        }
+        for (i = 0; i < SIZED_BLOCKS; i++) {
+            check(p[i], sizes[i], (int) (i & 0xff));
+            if (i % 3 == 0) {
+                free_aligned_sized(p[i], 16, sizes[i]);
+            } else if (i % 3 == 1) {
+                free_sized(p[i], sizes[i]);
+            } else {
+                free(p[i]);
+            }
+        }
+    }
+    for (round = 0; round < SIZED_ROUNDS; round++) {
+        for (i = 0; i < SIZED_ALIGNED; i++) {
+            align = (size_t) 64 << (i % 16);
+            if (posix_memalign(&aligned[i], align, 16)) {
+                fail("posix_memalign", align, 16);
+            }
+            memset(aligned[i], 0x77, 16);
+        }
+        for (i = 0; i < SIZED_ALIGNED; i++) {
+            free_aligned_sized(aligned[i], (size_t) 64 << (i % 16), 16);
+        }
+        for (i = 0; i < SIZED_SMALL; i++) {
+            if (!(small[i] = malloc(16))) {
+                fail("malloc", 16, 0);
+            }
+            if (malloc_usable_size(small[i]) > 4096) {
+                fail("small block is an aligned one", malloc_usable_size(small[i]), i);
+            }
+            memset(small[i], 0x11, 16);
+        }
+        for (i = 0; i < SIZED_SMALL; i++) {
+            free_sized(small[i], 16);
+        }
+    }
+    return 0;
+}
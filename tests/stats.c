@@ -0,0 +1,133 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* malloc_get_stats, in a build with -DMALLOC_STATS. Blocks of sizes
+ * that fall in known request buckets are allocated, some by a thread that
+ * exits before they're freed, and the counts have to go up by exactly
+ * those blocks and come back down once they are all freed. Nothing else
+ * may allocate in between, so there's no stdio until the end.
+ */
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "my_malloc.h"
+
+#define STATS_TEST_BLOCKS 1000
+#define STATS_TEST_SIZES 5
+
+/* Each size and the bucket it goes in, 16 << bucket being the smallest
+ * bound it fits under.
+ */
+static const size_t sizes[STATS_TEST_SIZES] = { 1, 17, 100, 4096, 8 << 20 };
+static const unsigned int buckets[STATS_TEST_SIZES] = { 0, 1, 3, 8, 19 };
+
+static void *blocks[STATS_TEST_SIZES][STATS_TEST_BLOCKS];
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "stats: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static size_t count(size_t i)
+{
+    return sizes[i] > 4096 ? 4 : STATS_TEST_BLOCKS;
+}
+
+/* Allocates the blocks of sizes[i] and returns their usable bytes.
+ */
+static size_t alloc_size(size_t i)
+{
+    size_t total = 0;
+    size_t j;
+    for (j = 0; j < count(i); j++) {
+        if (!(blocks[i][j] = malloc(sizes[i]))) {
+            fail("malloc", sizes[i], j);
+        }
+        total += malloc_usable_size(blocks[i][j]);
+    }
+    return total;
+}
+
+static void *alloc_thread(void *arg)
+{
+    return (void *) alloc_size((size_t) arg);
+}
+
+static void get(struct malloc_stats *st)
+{
+    if (malloc_get_stats(st)) {
+        fail("not built with MALLOC_STATS", 0, 0);
+    }
+    if (st->peak_in_use_bytes < st->in_use_bytes) {
+        fail("peak below in use", st->peak_in_use_bytes, st->in_use_bytes);
+    }
+}
+
+int main()
+{
+    struct malloc_stats before;
+    struct malloc_stats during;
+    struct malloc_stats after;
+    pthread_t thread;
+    void *ret;
+    size_t bytes = 0;
+    size_t nblocks = 0;
+    size_t i;
+    size_t j;
+    /* Gets the thread and the heap set up, and the threads' first
+     * allocations out of the way.
+     */
+    if (pthread_create(&thread, NULL, alloc_thread, (void *) 0) || pthread_join(thread, &ret)) {
+        fail("pthread", 0, 0);
+    }
+    for (j = 0; j < count(0); j++) {
+        free(blocks[0][j]);
+    }
+    get(&before);
+    for (i = 0; i < STATS_TEST_SIZES; i++) {
+        if (i == 2) {
+            if (pthread_create(&thread, NULL, alloc_thread, (void *) i) || pthread_join(thread, &ret)) {
+                fail("pthread", i, 0);
+            }
+            bytes += (size_t) ret;
+        } else {
+            bytes += alloc_size(i);
+        }
+        nblocks += count(i);
+    }
+    get(&during);
+    for (i = 0; i < STATS_TEST_SIZES; i++) {
+        for (j = 0; j < count(i); j++) {
+            free(blocks[i][j]);
+        }
+    }
+    get(&after);
+    if (during.in_use_blocks != before.in_use_blocks + nblocks) {
+        fail("blocks in use", during.in_use_blocks - before.in_use_blocks, nblocks);
+    }
+    if (during.in_use_bytes != before.in_use_bytes + bytes) {
+        fail("bytes in use", during.in_use_bytes - before.in_use_bytes, bytes);
+    }
+    for (i = 0; i < STATS_TEST_SIZES; i++) {
+        if (during.requests[buckets[i]] - before.requests[buckets[i]] != count(i)) {
+            fail("requests in bucket", buckets[i], during.requests[buckets[i]] - before.requests[buckets[i]]);
+        }
+    }
+    if (after.in_use_blocks != before.in_use_blocks || after.in_use_bytes != before.in_use_bytes) {
+        fail("not back down after free", after.in_use_blocks, before.in_use_blocks);
+    }
+    /* Each thread holds back up to 64 KiB before it publishes.
+     */
+    if (after.peak_in_use_bytes + 2 * 64 * 1024 < during.in_use_bytes) {
+        fail("peak forgotten", after.peak_in_use_bytes, during.in_use_bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Threads doing random malloc, calloc, aligned_alloc, realloc and free
+ * over a table of slots, each block filled with a pattern that is checked
+ * before it's resized or freed, so any block handed out twice or
+ * clobbered by the allocator's own bookkeeping shows up. Every so often a
+ * block is big enough to need a region of its own.
+ *
+ *     ./stress [threads] [iterations]
+ */
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_MAX_THREADS 64
+#define STRESS_SLOTS 200
+#define STRESS_MAX_SIZE 300
+#define STRESS_BIG_SIZE 300000
+
+static int iterations = 50000;
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "stress: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+static void fill(unsigned char *c, size_t from, size_t n, size_t k)
+{
+    size_t i;
+    for (i = from; i < n; i++) {
+        c[i] = (unsigned char) (k ^ i);
+    }
+}
+
+static void check(unsigned char *c, size_t n, size_t k)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (c[i] != (unsigned char) (k ^ i)) {
+            fail("corrupt block", k, i);
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    uint64_t seed = (uintptr_t) arg * 2654435761u + 1;
+    unsigned char *p[STRESS_SLOTS] = {NULL};
+    size_t s[STRESS_SLOTS];
+    size_t k;
+    size_t sz;
+    size_t align;
+    size_t j;
+    void *q;
+    int op;
+    int i;
+    for (i = 0; i < iterations; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        k = (seed >> 33) % STRESS_SLOTS;
+        op = (seed >> 24) % 16;
+        sz = (seed >> 13) % STRESS_MAX_SIZE + 1;
+        if ((seed >> 20) % 50 == 0) {
+            sz = (seed >> 13) % STRESS_BIG_SIZE + 1;
+        }
+        if (p[k]) {
+            check(p[k], s[k], k);
+            if (op < 4) {
+                if (!(q = realloc(p[k], sz))) {
+                    fail("realloc", sz, 0);
+                }
+                p[k] = q;
+                check(q, sz < s[k] ? sz : s[k], k);
+                fill(q, sz < s[k] ? sz : s[k], sz, k);
+                s[k] = sz;
+            } else {
+                free(p[k]);
+                p[k] = NULL;
+                continue;
+            }
+        } else {
+            s[k] = sz;
+            if (op == 5) {
+                p[k] = calloc(1, sz);
+                for (j = 0; p[k] && j < sz; j++) {
+                    if (p[k][j]) {
+                        fail("calloc not zero", sz, j);
+                    }
+                }
+            } else if (op == 6) {
+                align = (size_t) 16 << ((seed >> 40) % 8);
+                p[k] = aligned_alloc(align, (sz + align - 1) & ~(align - 1));
+                if (p[k] && ((uintptr_t) p[k] & (align - 1))) {
+                    fail("misaligned", align, (uintptr_t) p[k]);
+                }
+            } else {
+                p[k] = malloc(sz);
+            }
+            if (!p[k]) {
+                fail("out of memory", sz, 0);
+            }
+            fill(p[k], 0, sz, k);
+        }
+        if (malloc_usable_size(p[k]) < s[k]) {
+            fail("usable size too small", malloc_usable_size(p[k]), s[k]);
+        }
+    }
+    for (k = 0; k < STRESS_SLOTS; k++) {
+        free(p[k]);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[STRESS_MAX_THREADS];
+    int n = 4;
+    int i;
+    if (argc > 1) {
+        n = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        iterations = atoi(argv[2]);
+    }
+    if (n < 1 || n > STRESS_MAX_THREADS) {
+        n = 4;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *) (uintptr_t) (i + 1));
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Allocation traces. A copy of this program re-executed with
+ * MYMALLOC_TRACE set makes a known set of calls, and replay has to find
+ * every one of them in the trace and pair every free with its
+ * allocation, and sizeclass has to make classes out of it. A trace whose
+ * header claims it ends inside the header has to be turned away by both.
+ * Run from the top of the tree, where replay and sizeclass are.
+ */
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_TEST_BLOCKS 1000
+
+static void fail(const char *what, unsigned long long a, unsigned long long b)
+{
+    fprintf(stderr, "trace: %s (%llu, %llu)\n", what, a, b);
+    abort();
+}
+
+/* Makes 5 calls per block.
+ */
+static void record()
+{
+    static void *p[TRACE_TEST_BLOCKS];
+    int i;
+    for (i = 0; i < TRACE_TEST_BLOCKS; i++) {
+        p[i] = i % 3 ? malloc(i % 500 + 1) : calloc(1, i % 500 + 1);
+        p[i] = realloc(p[i], i % 700 + 1);
+    }
+    for (i = 0; i < TRACE_TEST_BLOCKS; i++) {
+        free(p[i]);
+        p[i] = memalign(64, i % 300 + 1);
+    }
+    for (i = 0; i < TRACE_TEST_BLOCKS; i++) {
+        free(p[i]);
+    }
+}
+
+/* Runs cmd with the trace at path and returns its exit status, with the
+ * first line it wrote to either stdout or stderr in line.
+ */
+static int run(const char *cmd, const char *path, char *line, size_t len)
+{
+    char buf[256];
+    FILE *f;
+    snprintf(buf, sizeof(buf), "%s %s 2>&1", cmd, path);
+    if (!(f = popen(buf, "r"))) {
+        fail("popen", 0, 0);
+    }
+    line[0] = 0;
+    if (!fgets(line, len, f)) {
+        line[0] = 0;
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+    }
+    return pclose(f);
+}
+
+/* A copy of the trace at path whose header says it ends at end.
+ */
+static void write_bad(const char *path, const char *bad, uint64_t end)
+{
+    static char page[TRACE_HEADER_SIZE];
+    struct trace_header *hdr = (struct trace_header *) page;
+    int in = open(path, O_RDONLY);
+    int out = open(bad, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (in < 0 || out < 0 || read(in, page, sizeof(page)) != sizeof(page)) {
+        fail("copy", in, out);
+    }
+    hdr->end = end;
+    if (write(out, page, sizeof(page)) != sizeof(page) || ftruncate(out, 4 * TRACE_HEADER_SIZE)) {
+        fail("write", 0, 0);
+    }
+    close(in);
+    close(out);
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/mymalloc-trace-XXXXXX";
+    char bad[sizeof(path) + 4];
+    char line[512];
+    char *s;
+    unsigned long long events;
+    unsigned long long unmatched;
+    pid_t pid;
+    int status;
+    int fd;
+    if (argc > 1 && !strcmp(argv[1], "record")) {
+        record();
+        return 0;
+    }
+    if ((fd = mkstemp(path)) < 0) {
+        fail("mkstemp", 0, 0);
+    }
+    close(fd);
+    if ((pid = fork()) < 0) {
+        fail("fork", 0, 0);
+    }
+    if (!pid) {
+        setenv("MYMALLOC_TRACE", path, 1);
+        execl(argv[0], argv[0], "record", (char *) NULL);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fail("recording", status, 0);
+    }
+    if (run("./replay", path, line, sizeof(line))
+            || !(s = strstr(line, "\"events\":"))
+            || sscanf(s, "\"events\":%llu,\"unmatched\":%llu", &events, &unmatched) != 2) {
+        fail("replay", 0, 0);
+    }
+    if (events < 5 * TRACE_TEST_BLOCKS || unmatched) {
+        fail("replayed events, unmatched", events, unmatched);
+    }
+    snprintf(bad, sizeof(bad), "%s.bad", path);
+    write_bad(path, bad, 5);
+    if (!run("./replay", bad, line, sizeof(line)) || !strstr(line, "not a trace")) {
+        fprintf(stderr, "trace: replay said %s", line);
+        fail("replay took a header ending at 5", 0, 0);
+    }
+    /* The summary on stderr comes out ahead of the buffered tables.
+     */
+    if (run("./sizeclass", path, line, sizeof(line)) || !strstr(line, "classes waste")) {
+        fprintf(stderr, "trace: sizeclass said %s", line);
+        fail("sizeclass", 0, 0);
+    }
+    if (!run("./sizeclass", bad, line, sizeof(line)) || !strstr(line, "not a trace")) {
+        fprintf(stderr, "trace: sizeclass said %s", line);
+        fail("sizeclass took a header ending at 5", 0, 0);
+    }
+    unlink(bad);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Giving free pages back. A working set is touched and freed, and its
+ * pages have to leave RSS: at once with malloc_trim, and then, in a copy
+ * re-executed with a short MYMALLOC_DECAY_MS, on their own after a
+ * couple of decay periods of nothing but the odd malloc and free.
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRIM_BLOCKS 2048
+#define TRIM_BLOCK_SIZE (32 * 1024)
+#define TRIM_DECAY_MS "20"
+
+static void *blocks[TRIM_BLOCKS];
+
+static void fail(const char *what, size_t a, size_t b)
+{
+    fprintf(stderr, "trim: %s (%zu, %zu)\n", what, a, b);
+    abort();
+}
+
+/* Resident bytes, from /proc/self/statm.
+ */
+static size_t resident()
+{
+    unsigned long size;
+    unsigned long pages;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%lu %lu", &size, &pages) != 2) {
+        fail("statm", 0, 0);
+    }
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Allocates and touches the working set, frees it and returns the RSS it
+ * had.
+ */
+static size_t churn()
+{
+    size_t rss;
+    size_t i;
+    for (i = 0; i < TRIM_BLOCKS; i++) {
+        if (!(blocks[i] = malloc(TRIM_BLOCK_SIZE))) {
+            fail("malloc", i, 0);
+        }
+        memset(blocks[i], 0x42, TRIM_BLOCK_SIZE);
+    }
+    rss = resident();
+    for (i = 0; i < TRIM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    return rss;
+}
+
+/* Whether RSS went from before down by at least a part of the working
+ * set.
+ */
+static int dropped(size_t before, size_t after, size_t part)
+{
+    return after + (size_t) TRIM_BLOCKS * TRIM_BLOCK_SIZE / part <= before;
+}
+
+int main(int argc, char **argv)
+{
+    size_t before;
+    size_t after;
+    size_t part;
+    void *p;
+    int i;
+    if (!getenv("MYMALLOC_DECAY_MS")) {
+        /* Long enough that no decay pass gets in the way.
+         */
+        setenv("MYMALLOC_DECAY_MS", "1000000", 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    if (strcmp(getenv("MYMALLOC_DECAY_MS"), TRIM_DECAY_MS)) {
+        before = churn();
+        if (malloc_trim(0) != 1) {
+            fail("malloc_trim gave nothing back", 0, 0);
+        }
+        if (!dropped(before, after = resident(), 2)) {
+            fail("RSS after malloc_trim", before, after);
+        }
+        setenv("MYMALLOC_DECAY_MS", TRIM_DECAY_MS, 1);
+        execv(argv[0], argv);
+        perror("execv");
+        return 1;
+    }
+    /* Decay passes on huge page regions keep the huge page under each
+     * free block's links, which for the tree's many free blocks of a few
+     * MiB comes to about half of them.
+     */
+    part = getenv("MYMALLOC_HUGEPAGES") ? 4 : 2;
+    before = churn();
+    /* Decay runs from the slow paths, which a block this size takes.
+     */
+    for (i = 0; i < 10 && !dropped(before, after = resident(), part); i++) {
+        usleep(atoi(TRIM_DECAY_MS) * 2000);
+        if (!(p = malloc(TRIM_BLOCK_SIZE))) {
+            fail("malloc", 0, 0);
+        }
+        free(p);
+    }
+    if (!dropped(before, after, part)) {
+        fail("RSS after decay", before, after);
+    }
+    return 0;
+}
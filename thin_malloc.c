@@ -7,120 +7,591 @@
  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/* Boundary tags: every header carries the size of the block in front of
+ * it (valid while that block is free) and flags saying whether the block
+ * itself and the one in front of it are free. That lets free find and
+ * merge its physical neighbours without looking at the free list, which
+ * is then just a doubly linked list threaded through the free buffers.
+ *
+ * tlsf_algo is the same allocator with the single first-fit list swapped
+ * for two-level segregated fit: free blocks are binned by size into
+ * power-of-two ranges, each cut into TLSF_SL_COUNT linear steps, with a
+ * bitmap over each level so finding a big enough block is a couple of
+ * ctz's instead of a walk. Both malloc and free are then O(1).
+ *
+ * Two more flags track a free block's age for purging, the same way as
+ * in fat_malloc.c.
+ */
+#include <stdint.h>
 #include <stdio.h>
 #include "heap.h"
+#include "my_malloc.h"
 
 #define THIN_BLOCK(ptr) ((struct thin_block *) ptr - 1)
 #define BUFF(blk) ((char *) (blk + 1))
+#define THIN_FREE 0x1
+#define THIN_PREV_FREE 0x2
+#define THIN_AGED 0x4
+#define THIN_PURGED 0x8
+#define THIN_DECAY (THIN_AGED | THIN_PURGED)
+#define THIN_FLAGS (THIN_FREE | THIN_PREV_FREE | THIN_DECAY)
+#define SIZE(blk) ((blk)->sz & ~(size_t) THIN_FLAGS)
+#define NEXT_BLOCK(blk) ((struct thin_block *) (BUFF(blk) + SIZE(blk)))
+#define PREV_BLOCK(blk) ((struct thin_block *) ((char *) (blk) - (blk)->prev_sz) - 1)
+/* A free block needs room for its links.
+ */
+#define MIN_SIZE sizeof(struct thin_links)
+#define THIN_MAX_SIZE (SIZE_MAX >> 2)
 
 struct thin_block {
-    struct thin_block *next;
+    size_t prev_sz;
     size_t sz;
 };
 
-static struct thin_block *free_list = NULL;
+/* Lives in the buffer of a free block.
+ */
+struct thin_links {
+    struct thin_block *next;
+    struct thin_block *prev;
+};
 
-void thin_init_heap(struct heap_info *info)
+#define LINKS(blk) ((struct thin_links *) BUFF(blk))
+
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+/* Sizes below 1 << TLSF_FL_SHIFT all go in first level 0, in 16 byte
+ * steps.
+ */
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4)
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+
+/* Free structures of one arena.
+ */
+struct thin_heap {
+    int tlsf;
+    struct thin_block *free_list;
+    uint64_t tlsf_fl_bitmap;
+    uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+    struct thin_block *tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+
+static struct thin_heap thin_heaps[HEAP_MAX_ARENAS];
+
+/* 0 for a size no region could hold, which would wrap if rounded.
+ */
+static size_t round_size(size_t sz)
 {
-    struct thin_block *tmp = (struct thin_block *) info->heap;
-    tmp->next = NULL;
-    tmp->sz = info->size - sizeof(*tmp);
-    free_list = tmp;
+    if (sz > THIN_MAX_SIZE) {
+        return 0;
+    }
+    sz = (sz + 15) & ~(size_t) 15;
+    return sz < MIN_SIZE ? MIN_SIZE : sz;
 }
 
-void thin_print_free_list()
+static void tlsf_mapping(size_t sz, int *fl, int *sl)
+{
+    int bit;
+    if (sz < (1 << TLSF_FL_SHIFT)) {
+        *fl = 0;
+        *sl = sz >> 4;
+    } else {
+        bit = 63 - __builtin_clzll(sz);
+        *sl = (sz >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = bit - TLSF_FL_SHIFT + 1;
+    }
+}
+
+static struct thin_block **list_for(struct thin_heap *h, struct thin_block *blk)
+{
+    int fl;
+    int sl;
+    if (!h->tlsf) {
+        return &h->free_list;
+    }
+    tlsf_mapping(SIZE(blk), &fl, &sl);
+    return &h->tlsf_lists[fl][sl];
+}
+
+static void push(struct thin_heap *h, struct thin_block *blk)
+{
+    struct thin_block **head = list_for(h, blk);
+    int fl;
+    int sl;
+    LINKS(blk)->prev = NULL;
+    LINKS(blk)->next = *head;
+    if (*head) {
+        LINKS(*head)->prev = blk;
+    }
+    *head = blk;
+    if (h->tlsf) {
+        tlsf_mapping(SIZE(blk), &fl, &sl);
+        h->tlsf_fl_bitmap |= (uint64_t) 1 << fl;
+        h->tlsf_sl_bitmap[fl] |= 1U << sl;
+    }
+}
+
+static void unlink_block(struct thin_heap *h, struct thin_block *blk)
+{
+    struct thin_block **head = list_for(h, blk);
+    int fl;
+    int sl;
+    if (LINKS(blk)->prev) {
+        LINKS(LINKS(blk)->prev)->next = LINKS(blk)->next;
+    } else {
+        *head = LINKS(blk)->next;
+    }
+    if (LINKS(blk)->next) {
+        LINKS(LINKS(blk)->next)->prev = LINKS(blk)->prev;
+    }
+    if (h->tlsf && !*head) {
+        tlsf_mapping(SIZE(blk), &fl, &sl);
+        h->tlsf_sl_bitmap[fl] &= ~(1U << sl);
+        if (!h->tlsf_sl_bitmap[fl]) {
+            h->tlsf_fl_bitmap &= ~((uint64_t) 1 << fl);
+        }
+    }
+}
+
+/* Head of the first non-empty list whose blocks are all at least sz
+ * bytes. Rounding sz up to the next list boundary first is what makes
+ * this good fit rather than best fit, and what keeps it O(1).
+ */
+static struct thin_block *tlsf_find(struct thin_heap *h, size_t sz)
+{
+    uint64_t fl_map;
+    uint32_t sl_map;
+    int fl;
+    int sl;
+    if (sz >= (1 << TLSF_FL_SHIFT)) {
+        sz += ((size_t) 1 << (63 - __builtin_clzll(sz) - TLSF_SL_LOG2)) - 1;
+    }
+    tlsf_mapping(sz, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+    sl_map = h->tlsf_sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        fl_map = fl + 1 < TLSF_FL_COUNT ? h->tlsf_fl_bitmap & (~(uint64_t) 0 << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = h->tlsf_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return h->tlsf_lists[fl][sl];
+}
+
+/* One block's part in a purge, see struct alloc_algo. The links at the
+ * front of the buffer stay.
+ */
+static size_t purge_block(struct thin_block *blk, int all)
+{
+    size_t ret;
+    if (blk->sz & THIN_PURGED) {
+        return 0;
+    }
+    if (!all && !(blk->sz & THIN_AGED)) {
+        blk->sz |= THIN_AGED;
+        return 0;
+    }
+    ret = heap_purge_span(BUFF(blk) + sizeof(struct thin_links), BUFF(blk) + SIZE(blk),
+            all ? 0 : HEAP_PURGE_MIN);
+    if (ret) {
+        blk->sz |= THIN_PURGED;
+    }
+    return ret;
+}
+
+static void print_list(struct thin_block *tmp)
 {
-    struct thin_block *tmp = free_list;
-    printf("----------\n");
-    printf("Free list:\n");
-    printf("----------\n");
     while (tmp) {
         printf("addr: %p\n", tmp);
-        printf("size: %ld\n", tmp->sz);
+        printf("size: %ld\n", SIZE(tmp));
         printf("buffer: %p\n", BUFF(tmp));
         printf("\n");
-        tmp = tmp->next;
+        tmp = LINKS(tmp)->next;
     }
 }
 
-void *thin_malloc(size_t sz)
+void thin_print_free_list(struct heap_info *info)
 {
-    struct thin_block *last = NULL;
-    struct thin_block *tmp = free_list;
-    struct thin_block *next = NULL;
-    if (sz % 8)
-        sz = sz - (sz % 8) + 8;
-    while (tmp) {
-        if (tmp->sz >= sz) {
-            next = tmp->next;
-            if (tmp->sz > sz + sizeof(*next)) {
-                next = (struct thin_block *) (BUFF(tmp) + sz);
-                next->next = tmp->next;
-                next->sz = tmp->sz - sz - sizeof(*next);
-            }
-            if (last) {
-                last->next = next;
-            } else {
-                free_list = next;
+    struct thin_heap *h = &thin_heaps[info->arena];
+    int fl;
+    int sl;
+    printf("----------\n");
+    printf("Free list:\n");
+    printf("----------\n");
+    if (!h->tlsf) {
+        print_list(h->free_list);
+        return;
+    }
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            if (h->tlsf_lists[fl][sl]) {
+                printf("[%d][%d]\n", fl, sl);
+                print_list(h->tlsf_lists[fl][sl]);
             }
-            tmp->sz = sz;
-            return BUFF(tmp);
         }
-        last = tmp;
-        tmp = tmp->next;
-    };
-    return NULL;
+    }
+}
+
+/* Cut sz bytes off the front of blk, which is free but on no list, and
+ * return what is left over as another free block on no list, NULL if
+ * there wasn't enough to make one and blk keeps it all.
+ */
+static struct thin_block *carve(struct thin_block *blk, size_t sz)
+{
+    struct thin_block *next;
+    if (SIZE(blk) < sz + sizeof(*next) + MIN_SIZE) {
+        blk->sz &= ~(size_t) (THIN_FREE | THIN_DECAY);
+        NEXT_BLOCK(blk)->sz &= ~(size_t) THIN_PREV_FREE;
+        return NULL;
+    }
+    next = (struct thin_block *) (BUFF(blk) + sz);
+    next->sz = (SIZE(blk) - sz - sizeof(*next)) | THIN_FREE | (blk->sz & THIN_DECAY);
+    NEXT_BLOCK(next)->prev_sz = SIZE(next);
+    blk->sz = sz | (blk->sz & THIN_PREV_FREE);
+    return next;
+}
+
+/* A free block of at least sz bytes, or failing that the biggest one
+ * around (exactly for the first fit list, roughly for TLSF).
+ */
+static struct thin_block *find_or_largest(struct thin_heap *h, size_t sz)
+{
+    struct thin_block *tmp = h->free_list;
+    struct thin_block *best = NULL;
+    int fl;
+    int sl;
+    if (h->tlsf) {
+        if ((tmp = tlsf_find(h, sz)) || !h->tlsf_fl_bitmap) {
+            return tmp;
+        }
+        fl = 63 - __builtin_clzll(h->tlsf_fl_bitmap);
+        sl = 31 - __builtin_clz(h->tlsf_sl_bitmap[fl]);
+        return h->tlsf_lists[fl][sl];
+    }
+    for (; tmp && SIZE(tmp) < sz; tmp = LINKS(tmp)->next) {
+        if (!best || SIZE(tmp) > SIZE(best)) {
+            best = tmp;
+        }
+    }
+    return tmp ? tmp : best;
+}
+
+void *thin_malloc(struct heap_info *info, size_t sz)
+{
+    struct thin_heap *h = &thin_heaps[info->arena];
+    struct thin_block *tmp = h->free_list;
+    struct thin_block *next;
+    if (!(sz = round_size(sz))) {
+        return NULL;
+    }
+    if (h->tlsf) {
+        tmp = tlsf_find(h, sz);
+    } else {
+        while (tmp && SIZE(tmp) < sz) {
+            tmp = LINKS(tmp)->next;
+        }
+    }
+    if (!tmp) {
+        return NULL;
+    }
+    unlink_block(h, tmp);
+    if ((next = carve(tmp, sz))) {
+        push(h, next);
+    }
+    return BUFF(tmp);
 }
 
-void thin_coalesce_free_list()
+/* Blocks are cut one after another off a single free block that can
+ * hold the rest of the batch, or failing that off the biggest there is,
+ * so the lists only change once per block used.
+ */
+size_t thin_malloc_batch(struct heap_info *info, size_t sz, size_t n, void **ptrs)
 {
-    struct thin_block *tmp = free_list;
-    while (tmp->next) {
-        if ((struct thin_block *) (BUFF(tmp) + tmp->sz) == tmp->next) {
-            tmp->sz += tmp->next->sz + sizeof(*tmp->next);
-            tmp->next = tmp->next->next;
-        } else {
-            tmp = tmp->next;
+    struct thin_heap *h = &thin_heaps[info->arena];
+    struct thin_block *tmp;
+    size_t step;
+    size_t need;
+    size_t got = 0;
+    if (!(sz = round_size(sz))) {
+        return 0;
+    }
+    step = sz + sizeof(*tmp);
+    while (got < n) {
+        /* Past anything that could be free, the biggest block will do.
+         */
+        need = n - got < (SIZE_MAX >> 2) / step ? (n - got) * step - sizeof(*tmp) : SIZE_MAX >> 2;
+        tmp = find_or_largest(h, need);
+        if (!tmp || SIZE(tmp) < sz) {
+            break;
+        }
+        unlink_block(h, tmp);
+        do {
+            ptrs[got++] = BUFF(tmp);
+            tmp = carve(tmp, sz);
+        } while (tmp && got < n && SIZE(tmp) >= sz);
+        if (tmp) {
+            push(h, tmp);
         }
     }
+    return got;
 }
 
-int coalesce(struct thin_block *blk)
+void thin_free(struct heap_info *info, void *ptr)
 {
-    if ((struct thin_block *) (BUFF(blk) + blk->sz) == blk->next) {
-        blk->sz += blk->next->sz + sizeof(*blk->next);
-        blk->next = blk->next->next;
-        return 1;
+    struct thin_heap *h = &thin_heaps[info->arena];
+    struct thin_block *blk = THIN_BLOCK(ptr);
+    struct thin_block *tmp;
+    /* Aged neighbours are purged as they merge, see purge in heap.h.
+     */
+    if (blk->sz & THIN_PREV_FREE) {
+        tmp = PREV_BLOCK(blk);
+        unlink_block(h, tmp);
+        purge_block(tmp, 0);
+        tmp->sz += sizeof(*blk) + SIZE(blk);
+        blk = tmp;
+    }
+    tmp = NEXT_BLOCK(blk);
+    if (tmp->sz & THIN_FREE) {
+        unlink_block(h, tmp);
+        purge_block(tmp, 0);
+        blk->sz += sizeof(*tmp) + SIZE(tmp);
     }
+    blk->sz = (blk->sz & ~(size_t) THIN_DECAY) | THIN_FREE;
+    tmp = NEXT_BLOCK(blk);
+    tmp->prev_sz = SIZE(blk);
+    tmp->sz |= THIN_PREV_FREE;
+    push(h, blk);
+}
+
+/* Each run of blocks that sit next to each other is folded into one
+ * block first, which then goes back with a single thin_free.
+ */
+void thin_free_batch(struct heap_info *info, size_t n, void **ptrs)
+{
+    struct thin_block *blk;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        blk = THIN_BLOCK(ptrs[i]);
+        while (i + 1 < n && NEXT_BLOCK(blk) == THIN_BLOCK(ptrs[i + 1])) {
+            blk->sz += sizeof(*blk) + SIZE(NEXT_BLOCK(blk));
+            i++;
+        }
+        thin_free(info, BUFF(blk));
+    }
+}
+
+/* Each region ends in a zero sized block that is never free, so the
+ * last real block always has a next block to look at.
+ */
+int thin_add_region(struct heap_info *info, char *base, size_t size)
+{
+    struct thin_block *blk = (struct thin_block *) base;
+    struct thin_block *fence;
+    if (size < 2 * sizeof(*blk) + MIN_SIZE) {
+        return -1;
+    }
+    blk->sz = (size - 2 * sizeof(*blk)) & ~(size_t) 15;
+    fence = NEXT_BLOCK(blk);
+    fence->sz = 0;
+    thin_free(info, BUFF(blk));
     return 0;
 }
 
-void thin_free(void *ptr)
+void thin_init_heap(struct heap_info *info)
+{
+    struct thin_heap *h = &thin_heaps[info->arena];
+    h->tlsf = 0;
+    h->free_list = NULL;
+    thin_add_region(info, info->heap, info->size);
+}
+
+void tlsf_init_heap(struct heap_info *info)
+{
+    struct thin_heap *h = &thin_heaps[info->arena];
+    int fl;
+    int sl;
+    h->tlsf = 1;
+    h->tlsf_fl_bitmap = 0;
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        h->tlsf_sl_bitmap[fl] = 0;
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            h->tlsf_lists[fl][sl] = NULL;
+        }
+    }
+    thin_add_region(info, info->heap, info->size);
+}
+
+/* Give back whatever blk has past sz bytes, if there's enough of it to
+ * make a block out of.
+ */
+static void thin_trim(struct heap_info *info, struct thin_block *blk, size_t sz)
+{
+    struct thin_block *rest;
+    if (SIZE(blk) >= sz + sizeof(*rest) + MIN_SIZE) {
+        rest = (struct thin_block *) (BUFF(blk) + sz);
+        rest->sz = SIZE(blk) - sz - sizeof(*rest);
+        blk->sz = sz | (blk->sz & THIN_PREV_FREE);
+        thin_free(info, BUFF(rest));
+    }
+}
+
+int thin_resize(struct heap_info *info, void *ptr, size_t sz)
 {
-    struct thin_block *last = NULL;
-    struct thin_block *tmp = free_list;
-    while (tmp && (void *) tmp < ptr) {
-        last = tmp;
-        tmp = tmp->next;
+    struct thin_heap *h = &thin_heaps[info->arena];
+    struct thin_block *blk = THIN_BLOCK(ptr);
+    struct thin_block *next = NEXT_BLOCK(blk);
+    if (!(sz = round_size(sz))) {
+        return 0;
     }
-    THIN_BLOCK(ptr)->next = tmp;
-    if (last) {
-        last->next = THIN_BLOCK(ptr);
-        if (coalesce(last)) {
-            coalesce(last);
-        } else {
-            coalesce(THIN_BLOCK(ptr));
+    if (sz > SIZE(blk)) {
+        /* The only way to grow is to swallow the free block right after
+         * this one.
+         */
+        if (!(next->sz & THIN_FREE)
+                || SIZE(blk) + sizeof(*next) + SIZE(next) < sz) {
+            return 0;
         }
-    } else {
-        free_list = THIN_BLOCK(ptr);
-        coalesce(THIN_BLOCK(ptr));
+        unlink_block(h, next);
+        blk->sz += sizeof(*next) + SIZE(next);
+        NEXT_BLOCK(blk)->sz &= ~(size_t) THIN_PREV_FREE;
+    }
+    thin_trim(info, blk, sz);
+    return 1;
+}
+
+void *thin_memalign(struct heap_info *info, size_t align, size_t sz)
+{
+    char *ptr;
+    char *aligned;
+    struct thin_block *blk;
+    if (align <= 16) {
+        return thin_malloc(info, sz);
+    }
+    if (!(sz = round_size(sz)) || align > THIN_MAX_SIZE / 2) {
+        return NULL;
+    }
+    ptr = thin_malloc(info, sz + 2 * align);
+    if (!ptr) {
+        return NULL;
+    }
+    aligned = (char *) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+    if (aligned != ptr) {
+        /* Split the slop in front off into its own free block, which
+         * needs room for a header and its links.
+         */
+        if ((size_t) (aligned - ptr) < sizeof(*blk) + MIN_SIZE) {
+            aligned += align;
+        }
+        blk = THIN_BLOCK(aligned);
+        blk->sz = SIZE(THIN_BLOCK(ptr)) - (aligned - ptr);
+        THIN_BLOCK(ptr)->sz = (aligned - ptr - sizeof(*blk))
+            | (THIN_BLOCK(ptr)->sz & THIN_PREV_FREE);
+        thin_free(info, ptr);
     }
-    //thin_coalesce_free_list();
+    thin_trim(info, THIN_BLOCK(aligned), sz);
+    return aligned;
 }
 
+size_t thin_usable_size(void *ptr)
+{
+    return SIZE(THIN_BLOCK(ptr));
+}
+
+static size_t purge_list(struct thin_block *tmp, int all)
+{
+    size_t ret = 0;
+    for (; tmp; tmp = LINKS(tmp)->next) {
+        ret += purge_block(tmp, all);
+    }
+    return ret;
+}
+
+size_t thin_purge(struct heap_info *info, int all)
+{
+    struct thin_heap *h = &thin_heaps[info->arena];
+    size_t ret = 0;
+    int fl;
+    int sl;
+    if (!h->tlsf) {
+        return purge_list(h->free_list, all);
+    }
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            ret += purge_list(h->tlsf_lists[fl][sl], all);
+        }
+    }
+    return ret;
+}
+
+#ifdef MALLOC_STATS
+static void list_stats(struct thin_block *tmp, struct malloc_stats *st)
+{
+    for (; tmp; tmp = LINKS(tmp)->next) {
+        st->free_bytes += SIZE(tmp);
+        st->free_blocks++;
+        if (SIZE(tmp) > st->largest_free) {
+            st->largest_free = SIZE(tmp);
+        }
+    }
+}
+
+void thin_stats(struct heap_info *info, struct malloc_stats *st)
+{
+    struct thin_heap *h = &thin_heaps[info->arena];
+    int fl;
+    int sl;
+    if (!h->tlsf) {
+        list_stats(h->free_list, st);
+        return;
+    }
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            list_stats(h->tlsf_lists[fl][sl], st);
+        }
+    }
+}
+#endif
+
 struct alloc_algo thin_algo = {
+    .id = ALGO_THIN,
+    .fresh_zero = 1,
+    .link_size = sizeof(struct thin_links),
     .init = thin_init_heap,
     .malloc = thin_malloc,
     .free = thin_free,
+    .usable_size = thin_usable_size,
+    .resize = thin_resize,
+    .memalign = thin_memalign,
+    .malloc_batch = thin_malloc_batch,
+    .free_batch = thin_free_batch,
+    .add_region = thin_add_region,
+    .print_free_list = thin_print_free_list,
+    .purge = thin_purge,
+#ifdef MALLOC_STATS
+    .stats = thin_stats,
+#endif
+};
+
+struct alloc_algo tlsf_algo = {
+    .id = ALGO_THIN,
+    .fresh_zero = 1,
+    .link_size = sizeof(struct thin_links),
+    .init = tlsf_init_heap,
+    .malloc = thin_malloc,
+    .free = thin_free,
+    .usable_size = thin_usable_size,
+    .resize = thin_resize,
+    .memalign = thin_memalign,
+    .malloc_batch = thin_malloc_batch,
+    .free_batch = thin_free_batch,
+    .add_region = thin_add_region,
     .print_free_list = thin_print_free_list,
+    .purge = thin_purge,
+#ifdef MALLOC_STATS
+    .stats = thin_stats,
+#endif
 };
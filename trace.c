@@ -0,0 +1,205 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Recording side of the allocation trace, see trace.h for the format.
+ * Everything here runs inside malloc, so it must not allocate: events go
+ * straight into shared mappings of the trace file and the kernel writes
+ * them out. Each thread claims a block of the file at a time, so the only
+ * shared write is one atomic add per TRACE_BLOCK_EVENTS events.
+ *
+ * trace_map at the end is the reading side, for the tools.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_BLOCK_SIZE (TRACE_BLOCK_EVENTS * sizeof(struct trace_event))
+
+int trace_active = 0;
+
+static int trace_fd = -1;
+static struct trace_header *trace_header;
+static int trace_atfork_done = 0;
+static uint32_t trace_process;
+
+static __thread struct trace_event *trace_block;
+static __thread unsigned int trace_used;
+static __thread uint32_t trace_thread;
+
+/* Called once, with the heap lock held, when the heap is set up.
+ *
+ * Each process writing the file holds a shared flock on it. Whoever gets
+ * it exclusively knows nobody else is writing, and starts the file over;
+ * anyone else (a child exec'd by a traced program, say) adds to it, since
+ * truncating it would fault the other writers' mappings.
+ */
+void trace_init()
+{
+    const char *path = getenv("MYMALLOC_TRACE");
+    struct trace_header *hdr;
+    struct stat st;
+    int fd, owner;
+    if (!path || !*path) {
+        return;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    owner = !flock(fd, LOCK_EX | LOCK_NB);
+    if (owner ? ftruncate(fd, 0) || posix_fallocate(fd, 0, TRACE_HEADER_SIZE)
+            : flock(fd, LOCK_SH) || fstat(fd, &st) || st.st_size < TRACE_HEADER_SIZE) {
+        close(fd);
+        return;
+    }
+    hdr = mmap(NULL, TRACE_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    if (owner) {
+        memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+        hdr->version = TRACE_VERSION;
+        hdr->event_size = sizeof(struct trace_event);
+        hdr->end = TRACE_HEADER_SIZE;
+        flock(fd, LOCK_SH);
+    } else if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic))
+            || hdr->version != TRACE_VERSION) {
+        munmap(hdr, TRACE_HEADER_SIZE);
+        close(fd);
+        return;
+    }
+    trace_process = getpid();
+    trace_header = hdr;
+    trace_fd = fd;
+    __atomic_store_n(&trace_active, 1, __ATOMIC_RELEASE);
+}
+
+static int trace_new_block()
+{
+    uint64_t off = __atomic_fetch_add(&trace_header->end, TRACE_BLOCK_SIZE, __ATOMIC_RELAXED);
+    void *block;
+    /* Unlike ftruncate this never shrinks the file under another thread.
+     */
+    if (posix_fallocate(trace_fd, off, TRACE_BLOCK_SIZE)) {
+        return -1;
+    }
+    block = mmap(NULL, TRACE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, off);
+    if (block == MAP_FAILED) {
+        return -1;
+    }
+    if (trace_block) {
+        munmap(trace_block, TRACE_BLOCK_SIZE);
+    }
+    trace_block = block;
+    trace_used = 0;
+    return 0;
+}
+
+/* The block the forking thread was filling is shared with the parent,
+ * the child has to start its own.
+ */
+static void trace_after_fork()
+{
+    trace_block = NULL;
+    trace_thread = 0;
+    trace_process = getpid();
+}
+
+void trace_record(enum trace_op op, void *ptr, size_t size, uint64_t arg)
+{
+    struct trace_event *ev;
+    struct timespec ts;
+    /* Not in trace_init: pthread_atfork may allocate, and that can't
+     * happen under the heap lock. A nested call finds the flag set.
+     */
+    if (!__atomic_exchange_n(&trace_atfork_done, 1, __ATOMIC_RELAXED)) {
+        pthread_atfork(NULL, NULL, trace_after_fork);
+    }
+    if (!trace_block || trace_used == TRACE_BLOCK_EVENTS) {
+        if (trace_new_block()) {
+            return;
+        }
+    }
+    if (!trace_thread) {
+        trace_thread = syscall(SYS_gettid);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev = &trace_block[trace_used++];
+    ev->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->ptr = (uintptr_t) ptr;
+    ev->size = size;
+    ev->arg = arg;
+    ev->process = trace_process;
+    ev->thread = trace_thread;
+    ev->op = op;
+}
+
+/* Map the trace at path and check its header. Returns nonzero with errno
+ * set on failure: EINVAL if the file isn't a trace, EPROTO if it is one of
+ * another version or event size.
+ */
+int trace_map(const char *path, struct trace_file *tf)
+{
+    struct trace_header *hdr;
+    struct stat st;
+    uint64_t end;
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < TRACE_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    tf->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (tf->map == MAP_FAILED) {
+        return -1;
+    }
+    tf->map_size = st.st_size;
+    hdr = (struct trace_header *) tf->map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) || hdr->end < TRACE_HEADER_SIZE) {
+        trace_unmap(tf);
+        errno = EINVAL;
+        return -1;
+    }
+    if (hdr->version != TRACE_VERSION || hdr->event_size != sizeof(struct trace_event)) {
+        trace_unmap(tf);
+        errno = EPROTO;
+        return -1;
+    }
+    /* A writer that died between claiming a block and extending the file
+     * leaves end past the real size.
+     */
+    end = hdr->end < (uint64_t) st.st_size ? hdr->end : (uint64_t) st.st_size;
+    tf->events = (struct trace_event *) (tf->map + TRACE_HEADER_SIZE);
+    tf->nslots = (end - TRACE_HEADER_SIZE) / sizeof(struct trace_event);
+    return 0;
+}
+
+void trace_unmap(struct trace_file *tf)
+{
+    munmap(tf->map, tf->map_size);
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2015 Peter Enns
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Binary allocation traces, written by trace.c when MYMALLOC_TRACE names
+ * a file and read back by replay.c and sizeclass.c through trace_map.
+ *
+ * The file starts with a page holding the header, then blocks of
+ * TRACE_BLOCK_EVENTS events, each block written by a single thread in
+ * time order. A block's unused tail is left zero (TRACE_NONE), and blocks
+ * from different threads interleave, so a reader has to merge on time.
+ * Every process that inherits MYMALLOC_TRACE while the file is being
+ * written joins in, so ids are only unique per process.
+ */
+#ifndef _TRACE_H
+#define _TRACE_H
+#include <stdint.h>
+
+#define TRACE_MAGIC "MYMTRACE"
+#define TRACE_VERSION 2
+#define TRACE_HEADER_SIZE 4096
+#define TRACE_BLOCK_EVENTS 4096
+
+enum trace_op {
+    TRACE_NONE,
+    TRACE_MALLOC,
+    TRACE_FREE,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_MEMALIGN,
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    /* File offset where the next block goes. Bumped atomically through a
+     * shared mapping, so other processes can write to the file too.
+     */
+    uint64_t end;
+};
+
+/* ptr is the block the call returned, or the one being freed, and stands
+ * in as the block's id. For realloc arg is the old pointer, for memalign
+ * the alignment.
+ */
+struct trace_event {
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t arg;
+    uint32_t process;
+    uint32_t thread;
+    uint32_t op;
+    uint32_t pad;
+};
+
+/* A trace mapped for reading. Slots past the last event written are
+ * TRACE_NONE.
+ */
+struct trace_file {
+    char *map;
+    size_t map_size;
+    struct trace_event *events;
+    uint64_t nslots;
+};
+
+extern int trace_active;
+
+void trace_init();
+void trace_record(enum trace_op op, void *ptr, size_t size, uint64_t arg);
+int trace_map(const char *path, struct trace_file *tf);
+void trace_unmap(struct trace_file *tf);
+#endif
@@ -10,256 +10,448 @@
 /* So... I tried to come up with something original and ended up with something
  * that is probably roughly equivalent to "buddy-allocation." At least now I
  * know that buddy-allocation is.
+ *
+ * ...so now it is just that. Every region is one buddy tree, split all
+ * the way down to TREE_MIN_ORDER if need be. Free blocks of each order
+ * sit on a per-order list, and which nodes are split or handed out is
+ * kept in two bitmaps at the front of the region rather than in the
+ * blocks, indexed heap style (root is 1, children of n are 2n and 2n+1).
+ * Allocation pops the smallest order that fits and splits it down, free
+ * merges with its buddy for as long as the buddy is free. Both are loops
+ * over at most log2(region size) orders. Each set of lists keeps a mask
+ * of the orders that have free blocks, so finding the order to split
+ * from is a bit scan, and its top bit is the largest free block: a
+ * region or stripe that can't serve a request is passed over without
+ * looking at its lists or taking its lock.
+ *
+ * ctree_algo is the same tree made safe to call from several threads at
+ * once, so its arenas run without the arena lock. Each region is cut into
+ * TREE_STRIPES subtrees, and blocks smaller than a stripe live on free
+ * lists of the stripe they're in, under a lock of its own. Only whole
+ * stripes and bigger blocks go through the lock at the top of the region,
+ * so threads working in different stripes never touch the same lock or
+ * list. A stripe's node is split while the stripe is in use, and kept
+ * marked as allocated while it passes between the top and the stripe, so
+ * a merge at the top never mistakes it for free. The bitmaps are shared
+ * by all of them, so in this mode the bits are set and cleared atomically.
+ * In plain tree mode only the arena lock holder changes them, but
+ * find_block reads them without the lock from any thread, so there the
+ * words are still loaded and stored whole, as relaxed atomics.
+ *
+ * Blocks carry no header. A pointer finds its region through the region
+ * map in region.c and its order from the bitmaps, so what's handed out
+ * is the block itself: aligned to its size, and all of it usable, so a
+ * request for a power of two takes a block of just that size.
+ *
+ * Free blocks carry the same aged and purged flags as in fat_malloc.c for
+ * decay purging. Halves split off an aged block start out young.
  */
 #include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "heap.h"
+#include "my_malloc.h"
 
-/* Note: MAX_SPLITS currenty must be <= 7 */
-#define MAX_SPLITS 2
-#define MIN_BLOCK_SIZE (2 * (sizeof(tree_block_t)))
-#define RIGHT(block, level) ((tree_block_t *)(((size_t)block) + (block->size >> (level + 1))))
-#define TREE_BUFFER(block) ((void *)(block + 1))
-#define TREE_BLOCK(buffer) ((tree_block_t *)buffer - 1)
+/* Smallest block we'll split down to. It has to hold the free list
+ * links.
+ */
+#ifndef TREE_MIN_ORDER
+#define TREE_MIN_ORDER 5
+#endif
+#define TREE_MAX_ORDER 63
+#define BLOCK_SIZE(order) ((size_t) 1 << (order))
+#define TREE_STRIPES_LOG2 4
+#define TREE_STRIPES (1 << TREE_STRIPES_LOG2)
+
+#define TREE_AGED 0x1
+#define TREE_PURGED 0x2
+
+/* Sits at the start of a free block. Links are offsets from the start
+ * of the region, 0 for none; that's where the region's own header is, so
+ * no free block is ever there.
+ */
+struct tree_free {
+    size_t next;
+    size_t prev;
+    size_t flags;
+};
 
-/* TODO: see if we can actually make do with less metadata.
+/* Per-order free lists. In ctree mode avail is read without the lock,
+ * see has_order.
  */
-typedef struct _tree_block {
-    /* It's convenient, but allocated bit is redundant with free_space
-     * as far as I can tell.
+struct tree_lists {
+    /* Bit k is set while heads[k] isn't empty.
      */
-    unsigned char allocated : 1;
-    /* Necessary but could be used more cleverly.
-     */
-    unsigned char split_flags : 7;
-    /* It might be possible to calculate the parent pointer
-     * on the fly... Not sure.
-     */
-    struct _tree_block *parent;
-    /* Note: I think you can get rid of parent index
-     * if you resign yourself to doing a little more
-     * work on frees by always starting cleanups at
-     * lowest split
+    uint64_t avail;
+    size_t free_space;
+    size_t heads[TREE_MAX_ORDER + 1];
+};
+
+/* Free blocks below the stripe order, in ctree mode.
+ */
+struct tree_stripe {
+    pthread_mutex_t lock;
+    struct tree_lists lists;
+} __attribute__((aligned(64)));
+
+/* At the start of the region, followed by the split and allocated
+ * bitmaps of words words each, then the stripes if there are any.
+ */
+struct tree_region {
+    /* The next region of the arena. The only pointer in the region, and
+     * one that means nothing outside the process that set it.
      */
-    int parent_index;
-    /* I think size might actually be necessary. Not for allocations,
-     * but for frees. Even if it isn't necessary, it's extremely convenient.
+    struct tree_region *next;
+    int order;
+    /* Order of the stripes, 0 unless in ctree mode.
      */
-    size_t size;
-    /* 100% necessary.
+    int stripe_order;
+    struct tree_lists lists;
+    size_t words;
+    size_t stripes;
+    /* Guards lists in ctree mode.
      */
-    size_t free_space;
-} tree_block_t;
+    pthread_mutex_t lock;
+};
 
-tree_block_t *free_tree = NULL;
+/* Regions of each arena, in the order they were added.
+ */
+static struct tree_region *tree_regions[HEAP_MAX_ARENAS];
 
-/* TODO: split flags should really just be treated as a number
- * since you will never have a node that is split at a lower node
- * and not a higher one. This will allow more splits with less bits.
+static unsigned int stripe_next = 0;
+static __thread unsigned int stripe_hint;
+
+/* Everything in a region is found from the region itself, which is also
+ * where its offsets count from, so a region works wherever it is mapped.
+ * See pheap.c.
  */
-static int is_split_at(tree_block_t *block, int level) {
-    return level < MAX_SPLITS && ((block->split_flags >> level) & 0x1);
+static char *at(struct tree_region *r, size_t offset) {
+    return (char *) r + offset;
 }
 
-static void mark_split(tree_block_t *block, int level) {
-    if (level < MAX_SPLITS) {
-        block->split_flags |= 0x1 << level;
-    }
+static size_t offset_of(struct tree_region *r, void *ptr) {
+    return (char *) ptr - (char *) r;
+}
+
+static uint64_t *split_bits(struct tree_region *r) {
+    return (uint64_t *) (r + 1);
+}
+
+static uint64_t *alloc_bits(struct tree_region *r) {
+    return split_bits(r) + r->words;
+}
+
+static struct tree_stripe *stripes_of(struct tree_region *r) {
+    return (struct tree_stripe *) at(r, r->stripes);
+}
+
+static int test_bit(uint64_t *map, size_t i) {
+    return (__atomic_load_n(&map[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
 }
 
-static void unmark_split(tree_block_t *block, int level) {
-    if (level < MAX_SPLITS) {
-        block->split_flags &= ~(0x1 << level);
+static void set_bit(struct tree_region *r, uint64_t *map, size_t i) {
+    uint64_t *word = &map[i / 64];
+    if (r->stripe_order) {
+        __atomic_fetch_or(word, (uint64_t) 1 << (i % 64), __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) | (uint64_t) 1 << (i % 64),
+                __ATOMIC_RELAXED);
     }
 }
 
-static tree_block_t *left(tree_block_t *block, int level) {
-    if (!is_split_at(block, level)) {
-        return NULL;
+static void clear_bit(struct tree_region *r, uint64_t *map, size_t i) {
+    uint64_t *word = &map[i / 64];
+    if (r->stripe_order) {
+        __atomic_fetch_and(word, ~((uint64_t) 1 << (i % 64)), __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) & ~((uint64_t) 1 << (i % 64)),
+                __ATOMIC_RELAXED);
     }
-    return block;
 }
 
-static tree_block_t *right(tree_block_t *block, int level) {
-    if (!is_split_at(block, level)) {
-        return NULL;
+static struct tree_stripe *stripe_of(struct tree_region *r, char *block) {
+    return &stripes_of(r)[offset_of(r, block) >> r->stripe_order];
+}
+
+static size_t node_index(struct tree_region *r, char *block, int order) {
+    return ((size_t) 1 << (r->order - order)) + (offset_of(r, block) >> order);
+}
+
+static char *buddy_of(struct tree_region *r, char *block, int order) {
+    return at(r, offset_of(r, block) ^ BLOCK_SIZE(order));
+}
+
+/* Smallest order whose blocks hold size bytes.
+ */
+static int size_order(size_t size) {
+    if (size <= BLOCK_SIZE(TREE_MIN_ORDER)) {
+        return TREE_MIN_ORDER;
     }
-    return RIGHT(block, level);
+    return 64 - __builtin_clzll(size - 1);
 }
 
-/* Note: This MUST be used instead of the size
- * field whenever you need the size of a node
- * in an expression.
+/* The lists a block of this order goes on.
  */
-static size_t tree_block_size(tree_block_t *block, int level) {
-    return block->size >> level;
+static struct tree_lists *lists_for(struct tree_region *r, char *block, int order) {
+    return order < r->stripe_order ? &stripe_of(r, block)->lists : &r->lists;
 }
 
-static int can_split(tree_block_t *block, int level) {
-    return tree_block_size(block, level) >= MIN_BLOCK_SIZE && !is_split_at(block, MAX_SPLITS - 1);
+/* Whether l has a free block of at least order, good enough to decide
+ * whether to take the lock over it.
+ */
+static int has_order(struct tree_lists *l, int order) {
+    return (__atomic_load_n(&l->avail, __ATOMIC_RELAXED) >> order) != 0;
 }
 
-static int lowest_split(tree_block_t *block) {
-    int i = 0;
-    for (i = 0; i < MAX_SPLITS - 1; i++) {
-        if (!is_split_at(block, i)) {
-            break;
-        }
+static struct tree_free *free_at(struct tree_region *r, size_t offset) {
+    return (struct tree_free *) at(r, offset);
+}
+
+static void push_free(struct tree_region *r, char *block, int order) {
+    struct tree_free *f = (struct tree_free *) block;
+    struct tree_lists *l = lists_for(r, block, order);
+    f->flags = 0;
+    f->prev = 0;
+    f->next = l->heads[order];
+    if (f->next) {
+        free_at(r, f->next)->prev = offset_of(r, block);
+    } else {
+        __atomic_store_n(&l->avail, l->avail | BLOCK_SIZE(order), __ATOMIC_RELAXED);
     }
-    return i;
+    l->heads[order] = offset_of(r, block);
+    l->free_space += BLOCK_SIZE(order);
 }
 
-static void tree_block_init(tree_block_t *block, tree_block_t *parent, int parent_index, size_t size) {
-    block->allocated = 0;
-    block->split_flags = 0;
-    block->parent = parent;
-    block->parent_index = parent_index;
-    block->size = size;
-    block->free_space = size - sizeof(tree_block_t);
+static void remove_free(struct tree_region *r, char *block, int order) {
+    struct tree_free *f = (struct tree_free *) block;
+    struct tree_lists *l = lists_for(r, block, order);
+    if (f->prev) {
+        free_at(r, f->prev)->next = f->next;
+    } else if (!(l->heads[order] = f->next)) {
+        __atomic_store_n(&l->avail, l->avail & ~BLOCK_SIZE(order), __ATOMIC_RELAXED);
+    }
+    if (f->next) {
+        free_at(r, f->next)->prev = f->prev;
+    }
+    l->free_space -= BLOCK_SIZE(order);
 }
 
-/* Note: This MUST be used instead of the free_space
- * field whenever you need the free space of a node
- * in an expression.
+/* One block's part in a purge, see struct alloc_algo. Called with the
+ * lock over its free list held.
  */
-static size_t free_space(tree_block_t *block, int level) {
-    int i;
-    size_t space = block->free_space;
-    tree_block_t *tmp = NULL;
-    for (i = 0; i < level; i++) {
-        tmp = right(block, i);
-        space -= tmp->free_space;
+static size_t purge_block(char *block, int order, int all) {
+    struct tree_free *f = (struct tree_free *) block;
+    size_t ret;
+    if (f->flags & TREE_PURGED) {
+        return 0;
+    }
+    if (!all && !(f->flags & TREE_AGED)) {
+        f->flags |= TREE_AGED;
+        return 0;
+    }
+    ret = heap_purge_span(block + sizeof(*f), block + BLOCK_SIZE(order), all ? 0 : HEAP_PURGE_MIN);
+    if (ret) {
+        f->flags |= TREE_PURGED;
     }
-    return space;
+    return ret;
 }
 
-static int fits(tree_block_t *block, int level, size_t size) {
-    return size <= free_space(block, level);
+static int is_free_node(struct tree_region *r, size_t node) {
+    return !test_bit(split_bits(r), node) && !test_bit(alloc_bits(r), node);
 }
 
-static int fits_after_split(tree_block_t *block, int level, size_t size) {
-    return size <= (tree_block_size(block, level) >> 1) - sizeof(tree_block_t);
+static struct tree_region *region_of(void *ptr) {
+    return (struct tree_region *) heap_region_of(ptr);
 }
 
-static void split(tree_block_t *block, int level) {
-    tree_block_t *r = RIGHT(block, level);
-    tree_block_init(r, block, level, tree_block_size(block, level) >> 1);
-    mark_split(block, level);
+/* The allocated block ptr points into, and its order. Nothing under an
+ * allocated node is ever marked, so that is the first marked node on the
+ * way up from the smallest block holding ptr. Its own bits don't change
+ * while it is allocated, so in ctree mode this needs no lock.
+ */
+static char *find_block(struct tree_region *r, void *ptr, int *order) {
+    size_t offset = offset_of(r, ptr);
+    size_t node = node_index(r, ptr, TREE_MIN_ORDER);
+    int k = TREE_MIN_ORDER;
+    while (!test_bit(alloc_bits(r), node)) {
+        node >>= 1;
+        k++;
+    }
+    *order = k;
+    return at(r, offset & ~(BLOCK_SIZE(k) - 1));
 }
 
-/* My intuition is that this algorithm makes for a good compromise
- * between first fit and best fit. Speed-wise, I think it should
- * even be better than first fit on average. It will be more wasteful
- * than a best fit into a linked list in terms of internal
- * fragmentation.
+/* Split a block of order k down to order, freeing the right halves,
+ * and hand out the left-most piece.
  */
-/* TODO: potential optimization: favor left instead of right when the
- * requested size is larger than half of the next smallest block size?
+static char *split_down(struct tree_region *r, char *block, int k, int order) {
+    size_t node = node_index(r, block, k);
+    while (k > order) {
+        set_bit(r, split_bits(r), node);
+        k--;
+        push_free(r, block + BLOCK_SIZE(k), k);
+        node <<= 1;
+    }
+    set_bit(r, alloc_bits(r), node);
+    return block;
+}
+
+/* Take a block of order from l, splitting the smallest free block that
+ * is big enough.
  */
-static tree_block_t *_alloc_internal(tree_block_t *block, size_t size, int level) {
-    tree_block_t *ret = NULL;
-    if (!block || !fits(block, level, size)) {
+static char *_alloc_internal(struct tree_region *r, struct tree_lists *l, int order) {
+    uint64_t fit = l->avail & ~(BLOCK_SIZE(order) - 1);
+    char *block;
+    int k;
+    if (!fit) {
         return NULL;
     }
-    if (!is_split_at(block, level)) {
-        /* Note: There are two reasons why you might not be able to split.
-         * Either we've reached a point where it is wasteful to split (metadata
-         * dominates the actual data), or 
-         * the requested # of bytes wouldn't fit in half the size of the current
-         * block.
+    k = __builtin_ctzll(fit);
+    block = at(r, l->heads[k]);
+    remove_free(r, block, k);
+    return split_down(r, block, k, order);
+}
+
+/* Free a block, merging up to order top at most. If that makes a whole
+ * stripe free, the stripe is left marked allocated instead and returned
+ * for the caller to free at the top of the region; otherwise NULL.
+ */
+static char *_free_internal(struct tree_region *r, char *block, int order, int top) {
+    size_t node = node_index(r, block, order);
+    char *buddy;
+    clear_bit(r, alloc_bits(r), node);
+    while (order < top && is_free_node(r, node ^ 1)) {
+        buddy = buddy_of(r, block, order);
+        remove_free(r, buddy, order);
+        /* See purge in heap.h.
          */
-        if (!can_split(block, level) || !fits_after_split(block, level, size)) {
-            /* TODO: I haven't thought of all the tweaks that would be necessary
-             * here but I don't think it would be too hard to fall back on a
-             * different heap allocator at this point to avoid excessive
-             * internal fragmentation.
-             */
-            block->allocated = 1;
-            block->free_space = free_space(block, 0) - free_space(block, level);
+        purge_block(buddy, order, 0);
+        if (buddy < block) {
+            block = buddy;
+        }
+        node >>= 1;
+        order++;
+        if (order == r->stripe_order) {
+            set_bit(r, alloc_bits(r), node);
+            clear_bit(r, split_bits(r), node);
             return block;
         }
-        split(block, level);
-    }
-    ret = _alloc_internal(right(block, level), size, 0);
-    if (!ret) {
-        ret = _alloc_internal(left(block, level), size, level + 1);
-    }
-    if (ret) {
-        block->free_space = free_space(block, level + 1) + free_space(right(block, level), 0);
-        assert(block->free_space >= 0);
-        return ret;
+        clear_bit(r, split_bits(r), node);
     }
+    push_free(r, block, order);
     return NULL;
 }
 
-static int is_free(tree_block_t *block, int level) {
-    return !block->allocated && !is_split_at(block, level);
-}
-
-static int can_reclaim(tree_block_t *block, int level) {
-    return is_free(left(block, level), level + 1) && is_free(right(block, level), 0);
-}
-
-static void _update_free_space(tree_block_t *block, size_t reclaimed) {
-    block->free_space = reclaimed + free_space(block, 0);
-    if (block->parent) {
-        _update_free_space(block->parent, reclaimed);
+static unsigned int thread_stripe() {
+    if (!stripe_hint) {
+        stripe_hint = __atomic_add_fetch(&stripe_next, 1, __ATOMIC_RELAXED);
     }
+    return stripe_hint;
 }
 
-static void _reclaim_and_update_free_space(tree_block_t *block, int level) {
-    int i;
-    size_t reclaimed;
-    for (i = level; i > 0; i--) {
-        if (can_reclaim(block, i - 1)) {
-            unmark_split(block, i - 1);
-        } else {
-            break;
+/* ctree mode. Small blocks come from the stripes, starting at one picked
+ * per thread and skipping any that are busy the first time round. Only
+ * when none of them has room is a fresh stripe taken from the top.
+ */
+static char *alloc_striped(struct tree_region *r, int order) {
+    struct tree_stripe *s;
+    char *block = NULL;
+    char *stripe;
+    unsigned int start;
+    unsigned int i;
+    int pass;
+    if (order >= r->stripe_order) {
+        if (!has_order(&r->lists, order)) {
+            return NULL;
         }
+        pthread_mutex_lock(&r->lock);
+        block = _alloc_internal(r, &r->lists, order);
+        pthread_mutex_unlock(&r->lock);
+        return block;
     }
-    reclaimed = tree_block_size(block, i) - sizeof(tree_block_t) - free_space(block, i);
-    if (i != 0) {
-        // Once we can't reclaim any more space than we already have, just
-        // update the free space in all the parents.
-        _update_free_space(block, reclaimed);
-    } else {
-        block->free_space = reclaimed + free_space(block, 0);
-        if (block->parent) {
-            _reclaim_and_update_free_space(block->parent, block->parent_index + 1);
+    start = thread_stripe();
+    for (pass = 0; pass < 2 && !block; pass++) {
+        for (i = 0; i < TREE_STRIPES && !block; i++) {
+            s = &stripes_of(r)[(start + i) % TREE_STRIPES];
+            if (!has_order(&s->lists, order)) {
+                continue;
+            }
+            if (pass ? pthread_mutex_lock(&s->lock) : pthread_mutex_trylock(&s->lock)) {
+                continue;
+            }
+            block = _alloc_internal(r, &s->lists, order);
+            pthread_mutex_unlock(&s->lock);
         }
     }
+    if (block || !has_order(&r->lists, r->stripe_order)) {
+        return block;
+    }
+    pthread_mutex_lock(&r->lock);
+    stripe = _alloc_internal(r, &r->lists, r->stripe_order);
+    pthread_mutex_unlock(&r->lock);
+    if (!stripe) {
+        return NULL;
+    }
+    s = stripe_of(r, stripe);
+    pthread_mutex_lock(&s->lock);
+    block = split_down(r, stripe, r->stripe_order, order);
+    clear_bit(r, alloc_bits(r), node_index(r, stripe, r->stripe_order));
+    pthread_mutex_unlock(&s->lock);
+    return block;
 }
 
-static void _free_internal(tree_block_t *block) {
-    int level = lowest_split(block);
-    block->allocated = 0;
-    _reclaim_and_update_free_space(block, level);
+/* Mark the first len bytes of a fresh region as in use, splitting along
+ * the boundary and freeing everything past it.
+ */
+static void reserve(struct tree_region *r, size_t len) {
+    size_t node = 1;
+    size_t start = 0;
+    int order = r->order;
+    while (start < len) {
+        if (start + BLOCK_SIZE(order) <= len) {
+            set_bit(r, alloc_bits(r), node);
+            return;
+        }
+        set_bit(r, split_bits(r), node);
+        order--;
+        if (len >= start + BLOCK_SIZE(order)) {
+            set_bit(r, alloc_bits(r), node << 1);
+            node = (node << 1) + 1;
+            start += BLOCK_SIZE(order);
+        } else {
+            push_free(r, at(r, start + BLOCK_SIZE(order)), order);
+            node <<= 1;
+        }
+    }
+    push_free(r, at(r, start), order);
 }
 
-static void _tree_block_print_tree(tree_block_t *block, int level, int tree_level) {
+static void _tree_block_print_tree(struct tree_region *r, size_t node, int order, int tree_level) {
     int i = 0;
     for (i = 0; i < tree_level; i++) {
         printf("  ");
     }
-    if (is_split_at(block, level)) {
+    if (test_bit(split_bits(r), node)) {
         printf("*\n");
-        _tree_block_print_tree(left(block, level), level + 1, tree_level + 1);
-        _tree_block_print_tree(right(block, level), 0, tree_level + 1);
+        _tree_block_print_tree(r, node << 1, order - 1, tree_level + 1);
+        _tree_block_print_tree(r, (node << 1) + 1, order - 1, tree_level + 1);
     } else {
-        printf("%ld\n", free_space(block, level));
+        printf("%ld\n", test_bit(alloc_bits(r), node) ? 0 : BLOCK_SIZE(order));
     }
 }
 
-static void _tree_block_print_mem(tree_block_t *block, int level) {
-    int i = 0;
-    if (is_split_at(block, level)) {
-        _tree_block_print_mem(left(block, level), level + 1);
-        _tree_block_print_mem(right(block, level), 0);
+static void _tree_block_print_mem(struct tree_region *r, size_t node, int order, size_t unit) {
+    size_t i = 0;
+    if (test_bit(split_bits(r), node)) {
+        _tree_block_print_mem(r, node << 1, order - 1, unit);
+        _tree_block_print_mem(r, (node << 1) + 1, order - 1, unit);
     } else {
         printf("|");
-        for (i = tree_block_size(block, level); i > 0; i -= MIN_BLOCK_SIZE) {
-            if (block->allocated) {
+        for (i = BLOCK_SIZE(order); i >= unit; i -= unit) {
+            if (test_bit(alloc_bits(r), node)) {
                 printf("#");
             } else {
                 printf("_");
@@ -268,62 +460,537 @@ static void _tree_block_print_mem(tree_block_t *block, int level) {
     }
 }
 
-int is_power_of_two(unsigned int x) {
+int is_power_of_two(size_t x) {
       return ((x != 0) && !(x & (x - 1)));
 }
 
+/* Lay out a region at base, with stripes if it's for ctree mode and big
+ * enough to have them.
+ */
+static int format_region(char *base, size_t size, int concurrent) {
+    struct tree_region *r = (struct tree_region *) base;
+    size_t meta;
+    int i;
+    if (!is_power_of_two(size) || size < BLOCK_SIZE(TREE_MIN_ORDER + 1)) {
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->order = __builtin_ctzll(size);
+    r->words = ((size_t) 2 << (r->order - TREE_MIN_ORDER)) / 64 + 1;
+    memset(split_bits(r), 0, 2 * r->words * sizeof(uint64_t));
+    meta = offset_of(r, alloc_bits(r) + r->words);
+    if (concurrent && r->order - TREE_STRIPES_LOG2 > TREE_MIN_ORDER) {
+        meta = (meta + 63) & ~(size_t) 63;
+        r->stripes = meta;
+        r->stripe_order = r->order - TREE_STRIPES_LOG2;
+        pthread_mutex_init(&r->lock, NULL);
+        for (i = 0; i < TREE_STRIPES; i++) {
+            memset(&stripes_of(r)[i], 0, sizeof(stripes_of(r)[i]));
+            pthread_mutex_init(&stripes_of(r)[i].lock, NULL);
+        }
+        meta += TREE_STRIPES * sizeof(struct tree_stripe);
+    }
+    meta = (meta + BLOCK_SIZE(TREE_MIN_ORDER) - 1) & ~(BLOCK_SIZE(TREE_MIN_ORDER) - 1);
+    if (meta >= size) {
+        return -1;
+    }
+    reserve(r, meta);
+    return 0;
+}
+
+int tree_add_region(struct heap_info *info, char *base, size_t size) {
+    struct tree_region **tail = &tree_regions[info->arena];
+    if (format_region(base, size, info->concurrent)) {
+        return -1;
+    }
+    /* Other threads walk the list without a lock in ctree mode, and new
+     * regions only ever go on the end.
+     */
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    __atomic_store_n(tail, (struct tree_region *) base, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* A region on its own, on no arena's list and without stripes, for
+ * pheap.c. The caller does the locking and knows which region a pointer
+ * is in, so none of these go through the region map.
+ */
+int tree_region_format(char *base, size_t size) {
+    return format_region(base, size, 0);
+}
+
+/* Take up a region formatted by tree_region_format, possibly by another
+ * process and at another address. Returns nonzero if base doesn't look
+ * like one of size bytes.
+ */
+int tree_region_attach(char *base, size_t size) {
+    struct tree_region *r = (struct tree_region *) base;
+    if (!is_power_of_two(size) || size < BLOCK_SIZE(TREE_MIN_ORDER + 1)
+            || r->order != __builtin_ctzll(size) || r->stripe_order
+            || r->words != ((size_t) 2 << (r->order - TREE_MIN_ORDER)) / 64 + 1) {
+        return -1;
+    }
+    r->next = NULL;
+    return 0;
+}
+
+/* Put the free blocks under node back on the lists, going by the bitmaps
+ * alone. Returns nonzero if the whole node is free, for the caller to
+ * merge with its buddy; halves that are both free are merged on the way
+ * up, since a free that was cut short can leave them apart.
+ */
+static int rebuild_node(struct tree_region *r, size_t node, int order, size_t offset) {
+    int left;
+    int right;
+    /* The region's own header is always at offset 0 and never free,
+     * and nothing is split below TREE_MIN_ORDER; bits that say otherwise
+     * can't be trusted, and what they cover stays out of reach.
+     */
+    if (!test_bit(split_bits(r), node)) {
+        return offset && !test_bit(alloc_bits(r), node);
+    }
+    if (order == TREE_MIN_ORDER) {
+        return 0;
+    }
+    left = rebuild_node(r, node << 1, order - 1, offset);
+    right = rebuild_node(r, (node << 1) + 1, order - 1, offset + BLOCK_SIZE(order - 1));
+    if (left && right) {
+        clear_bit(r, split_bits(r), node);
+        return 1;
+    }
+    if (left) {
+        push_free(r, at(r, offset), order - 1);
+    }
+    if (right) {
+        push_free(r, at(r, offset + BLOCK_SIZE(order - 1)), order - 1);
+    }
+    return 0;
+}
+
+/* For a region that was left halfway through an update: throw away the
+ * free lists, whose links may point anywhere, and make them again from
+ * the bitmaps. A block whose bits were set but that never made it back
+ * to its caller stays allocated, so the worst a crash costs is a leak.
+ * The region has to have been attached.
+ */
+void tree_region_rebuild(char *base) {
+    struct tree_region *r = (struct tree_region *) base;
+    memset(&r->lists, 0, sizeof(r->lists));
+    rebuild_node(r, 1, r->order, 0);
+}
+
+void *tree_region_alloc(char *base, size_t size) {
+    struct tree_region *r = (struct tree_region *) base;
+    if (size > BLOCK_SIZE(TREE_MAX_ORDER - 1)) {
+        return NULL;
+    }
+    return _alloc_internal(r, &r->lists, size_order(size));
+}
+
+void tree_region_free(char *base, void *ptr) {
+    struct tree_region *r = (struct tree_region *) base;
+    char *block;
+    int order;
+    block = find_block(r, ptr, &order);
+    _free_internal(r, block, order, r->order);
+}
+
+size_t tree_region_usable_size(char *base, void *ptr) {
+    int order;
+    char *block = find_block((struct tree_region *) base, ptr, &order);
+    return block + BLOCK_SIZE(order) - (char *) ptr;
+}
+
 void tree_init_heap(struct heap_info *info) {
-    free_tree = (tree_block_t *) info->heap;
+    tree_regions[info->arena] = NULL;
     /* less jarring way of handling this error would be
      * to choose the next lowest power of two below
      * info->size
      */
     assert(is_power_of_two(info->size));
-    tree_block_init(free_tree, NULL, 0, info->size);
+    tree_add_region(info, info->heap, info->size);
+}
+
+void *tree_alloc(struct heap_info *info, size_t size) {
+    struct tree_region *r;
+    char *block = NULL;
+    int order;
+    if (size > BLOCK_SIZE(TREE_MAX_ORDER - 1)) {
+        return NULL;
+    }
+    order = size_order(size);
+    r = __atomic_load_n(&tree_regions[info->arena], __ATOMIC_ACQUIRE);
+    for (; r && !block; r = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE)) {
+        if (r->stripe_order) {
+            block = alloc_striped(r, order);
+        } else {
+            block = _alloc_internal(r, &r->lists, order);
+        }
+    }
+    return block;
+}
+
+/* Hand out n blocks of order from the left of block, which is of order
+ * k and on no free list, and put the right halves none of them land in
+ * back on the lists. n can't be more than fit.
+ */
+static size_t carve(struct tree_region *r, char *block, int k, int order, size_t n, void **ptrs) {
+    size_t half;
+    size_t got;
+    if (k == order) {
+        set_bit(r, alloc_bits(r), node_index(r, block, order));
+        ptrs[0] = block;
+        return 1;
+    }
+    set_bit(r, split_bits(r), node_index(r, block, k));
+    half = (size_t) 1 << (k - 1 - order);
+    got = carve(r, block, k - 1, order, n < half ? n : half, ptrs);
+    if (n > half) {
+        got += carve(r, block + BLOCK_SIZE(k - 1), k - 1, order, n - half, ptrs + got);
+    } else {
+        push_free(r, block + BLOCK_SIZE(k - 1), k - 1);
+    }
+    return got;
+}
+
+/* Each pass takes one free block just big enough for what's left of the
+ * batch, or the biggest there is, and fills the subtree under it from
+ * the left. In ctree mode the stripes are gone through a block at a time
+ * instead.
+ */
+size_t tree_malloc_batch(struct heap_info *info, size_t size, size_t n, void **ptrs) {
+    struct tree_region *r;
+    char *block;
+    char *top;
+    uint64_t fit;
+    size_t got = 0;
+    size_t count;
+    int order;
+    int want;
+    int k;
+    if (size > BLOCK_SIZE(TREE_MAX_ORDER - 1)) {
+        return 0;
+    }
+    order = size_order(size);
+    r = __atomic_load_n(&tree_regions[info->arena], __ATOMIC_ACQUIRE);
+    for (; r && got < n; r = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE)) {
+        if (r->stripe_order) {
+            while (got < n && (block = alloc_striped(r, order))) {
+                ptrs[got++] = block;
+            }
+            continue;
+        }
+        while (got < n && order <= r->order) {
+            want = order + (n - got > 1 ? 64 - __builtin_clzll(n - got - 1) : 0);
+            if (want > r->order) {
+                want = r->order;
+            }
+            if ((fit = r->lists.avail & ~(BLOCK_SIZE(want) - 1))) {
+                k = __builtin_ctzll(fit);
+            } else if ((fit = r->lists.avail & ~(BLOCK_SIZE(order) - 1))) {
+                k = 63 - __builtin_clzll(fit);
+            } else {
+                break;
+            }
+            top = at(r, r->lists.heads[k]);
+            remove_free(r, top, k);
+            for (; k > want; k--) {
+                set_bit(r, split_bits(r), node_index(r, top, k));
+                push_free(r, top + BLOCK_SIZE(k - 1), k - 1);
+            }
+            count = (size_t) 1 << (k - order);
+            got += carve(r, top, k, order, n - got < count ? n - got : count, ptrs + got);
+        }
+    }
+    return got;
+}
+
+/* Sorted, buddies come in pairs and merge as they go.
+ */
+void tree_free_batch(struct heap_info *info, size_t n, void **ptrs) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        tree_free(info, ptrs[i]);
+    }
+}
+
+/* Regions are found from the pointer, so info goes unused.
+ */
+void tree_free(struct heap_info *info, void *ptr) {
+    struct tree_region *r = region_of(ptr);
+    struct tree_stripe *s;
+    char *block;
+    char *top;
+    int order;
+    (void) info;
+    block = find_block(r, ptr, &order);
+    if (!r->stripe_order) {
+        _free_internal(r, block, order, r->order);
+        return;
+    }
+    top = block;
+    if (order < r->stripe_order) {
+        s = stripe_of(r, block);
+        pthread_mutex_lock(&s->lock);
+        top = _free_internal(r, block, order, r->stripe_order);
+        pthread_mutex_unlock(&s->lock);
+        order = r->stripe_order;
+    }
+    if (top) {
+        pthread_mutex_lock(&r->lock);
+        _free_internal(r, top, order, r->order);
+        pthread_mutex_unlock(&r->lock);
+    }
 }
 
-void *tree_alloc(size_t size) {
-    return TREE_BUFFER(_alloc_internal(free_tree, size, 0));
+size_t tree_usable_size(void *ptr) {
+    int order;
+    char *block = find_block(region_of(ptr), ptr, &order);
+    return block + BLOCK_SIZE(order) - (char *) ptr;
 }
 
-void tree_free(void *ptr) {
-    _free_internal(TREE_BLOCK(ptr));
+/* Growing in place means merging with free right buddies, so only a
+ * block that is the left child at every order it grows through can do
+ * it. Shrinking splits the right halves back off.
+ */
+static int resize_block(struct tree_region *r, char *block, int from, int order) {
+    size_t offset = offset_of(r, block);
+    size_t node = node_index(r, block, from);
+    size_t n;
+    int k;
+    if (order > from) {
+        for (k = from, n = node; k < order; k++, n >>= 1) {
+            if (k >= r->order || (offset & BLOCK_SIZE(k)) || !is_free_node(r, n ^ 1)) {
+                return 0;
+            }
+        }
+        clear_bit(r, alloc_bits(r), node);
+        for (k = from; k < order; k++) {
+            remove_free(r, block + BLOCK_SIZE(k), k);
+            node >>= 1;
+            clear_bit(r, split_bits(r), node);
+        }
+        set_bit(r, alloc_bits(r), node);
+    } else if (order < from) {
+        clear_bit(r, alloc_bits(r), node);
+        for (k = from; k > order; ) {
+            set_bit(r, split_bits(r), node);
+            k--;
+            push_free(r, block + BLOCK_SIZE(k), k);
+            node <<= 1;
+        }
+        set_bit(r, alloc_bits(r), node);
+    }
+    return 1;
 }
 
-void tree_heap_print() {
-    _tree_block_print_tree(free_tree, 0, 0);
-    _tree_block_print_mem(free_tree, 0);
-    printf("|\n");
+/* In ctree mode only within a stripe, under its lock. A pointer into
+ * the middle of a block, from tree_memalign, stays where it is.
+ */
+int tree_resize(struct heap_info *info, void *ptr, size_t size) {
+    struct tree_region *r = region_of(ptr);
+    struct tree_stripe *s;
+    char *block;
+    int from;
+    int order;
+    int ret;
+    (void) info;
+    block = find_block(r, ptr, &from);
+    if (block != ptr) {
+        return size <= tree_usable_size(ptr);
+    }
+    if (size > BLOCK_SIZE(TREE_MAX_ORDER - 1)) {
+        return 0;
+    }
+    order = size_order(size);
+    if (!r->stripe_order) {
+        return resize_block(r, block, from, order);
+    }
+    if (order >= r->stripe_order || from >= r->stripe_order) {
+        return 0;
+    }
+    s = stripe_of(r, block);
+    pthread_mutex_lock(&s->lock);
+    ret = resize_block(r, block, from, order);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
 }
 
+/* Blocks are aligned to their size as far as the region is, which is
+ * at least HEAP_ALIGN, so up to that a big enough block is all it takes.
+ * Past it the aligned pointer is picked out of a bigger block, and
+ * find_block takes it back to the start when it's freed.
+ */
+void *tree_memalign(struct heap_info *info, size_t align, size_t size) {
+    char *ptr;
+    if (align <= HEAP_ALIGN) {
+        return tree_alloc(info, size > align ? size : align);
+    }
+    if (size > BLOCK_SIZE(TREE_MAX_ORDER - 1) - align) {
+        return NULL;
+    }
+    ptr = tree_alloc(info, size + align);
+    if (!ptr) {
+        return NULL;
+    }
+    return (char *) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+}
+
+void tree_heap_print(struct heap_info *info) {
+    struct tree_region *r;
+    size_t unit;
+    for (r = tree_regions[info->arena]; r; r = r->next) {
+        unit = BLOCK_SIZE(r->order) >> 10;
+        if (unit < BLOCK_SIZE(TREE_MIN_ORDER)) {
+            unit = BLOCK_SIZE(TREE_MIN_ORDER);
+        }
+        _tree_block_print_tree(r, 1, r->order, 0);
+        _tree_block_print_mem(r, 1, r->order, unit);
+        printf("|\n");
+    }
+}
+
+static size_t purge_lists(struct tree_region *r, struct tree_lists *l, int all) {
+    size_t f;
+    uint64_t orders;
+    size_t ret = 0;
+    int order;
+    for (orders = l->avail; orders; orders &= orders - 1) {
+        order = __builtin_ctzll(orders);
+        for (f = l->heads[order]; f; f = free_at(r, f)->next) {
+            ret += purge_block(at(r, f), order, all);
+        }
+    }
+    return ret;
+}
+
+size_t tree_purge(struct heap_info *info, int all) {
+    struct tree_region *r;
+    size_t ret = 0;
+    int i;
+    for (r = tree_regions[info->arena]; r; r = r->next) {
+        if (!r->stripe_order) {
+            ret += purge_lists(r, &r->lists, all);
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        ret += purge_lists(r, &r->lists, all);
+        pthread_mutex_unlock(&r->lock);
+        for (i = 0; i < TREE_STRIPES; i++) {
+            pthread_mutex_lock(&stripes_of(r)[i].lock);
+            ret += purge_lists(r, &stripes_of(r)[i].lists, all);
+            pthread_mutex_unlock(&stripes_of(r)[i].lock);
+        }
+    }
+    return ret;
+}
+
+#ifdef MALLOC_STATS
+static void list_stats(struct tree_region *r, struct tree_lists *l, struct malloc_stats *st) {
+    size_t f;
+    uint64_t orders;
+    int order;
+    for (orders = l->avail; orders; orders &= orders - 1) {
+        order = __builtin_ctzll(orders);
+        for (f = l->heads[order]; f; f = free_at(r, f)->next) {
+            st->free_bytes += BLOCK_SIZE(order);
+            st->free_blocks++;
+            if (BLOCK_SIZE(order) > st->largest_free) {
+                st->largest_free = BLOCK_SIZE(order);
+            }
+        }
+    }
+}
+
+void tree_stats(struct heap_info *info, struct malloc_stats *st) {
+    struct tree_region *r;
+    int i;
+    for (r = tree_regions[info->arena]; r; r = r->next) {
+        if (!r->stripe_order) {
+            list_stats(r, &r->lists, st);
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        list_stats(r, &r->lists, st);
+        pthread_mutex_unlock(&r->lock);
+        for (i = 0; i < TREE_STRIPES; i++) {
+            pthread_mutex_lock(&stripes_of(r)[i].lock);
+            list_stats(r, &stripes_of(r)[i].lists, st);
+            pthread_mutex_unlock(&stripes_of(r)[i].lock);
+        }
+    }
+}
+#endif
+
 struct alloc_algo tree_algo = {
+    .id = ALGO_TREE,
+    .fresh_zero = 1,
+    .link_size = sizeof(struct tree_free),
     .init = tree_init_heap,
     .malloc = tree_alloc,
     .free = tree_free,
+    .usable_size = tree_usable_size,
+    .resize = tree_resize,
+    .memalign = tree_memalign,
+    .malloc_batch = tree_malloc_batch,
+    .free_batch = tree_free_batch,
+    .add_region = tree_add_region,
     .print_free_list = tree_heap_print,
+    .purge = tree_purge,
+#ifdef MALLOC_STATS
+    .stats = tree_stats,
+#endif
+};
+
+struct alloc_algo ctree_algo = {
+    .id = ALGO_TREE,
+    .concurrent = 1,
+    .init = tree_init_heap,
+    .malloc = tree_alloc,
+    .free = tree_free,
+    .usable_size = tree_usable_size,
+    .resize = tree_resize,
+    .memalign = tree_memalign,
+    .malloc_batch = tree_malloc_batch,
+    .free_batch = tree_free_batch,
+    .add_region = tree_add_region,
+    .print_free_list = tree_heap_print,
+    .purge = tree_purge,
+#ifdef MALLOC_STATS
+    .stats = tree_stats,
+#endif
 };
 
 void tree_example() {
-    char heap[1024 * 1024];
-    free_tree = (tree_block_t *)heap;
-    tree_block_t *allocated = NULL;
-    tree_block_init(free_tree, NULL, 0, 1024 * 1024);
-    tree_heap_print();
-    printf("free: %ld\n", free_tree->free_space);
-    int *ptr = tree_alloc(sizeof(int));
-    tree_heap_print();
-    printf("free: %ld\n", free_tree->free_space);
+    struct heap_info info = {.arena = 0};
+    /* Blocks find their region through the region map, so the heap has
+     * to be mapped like a real one.
+     */
+    char *heap = heap_map_region(&info, 1024 * 1024);
+    if (!heap) {
+        return;
+    }
+    tree_regions[0] = NULL;
+    tree_add_region(&info, heap, 1024 * 1024);
+    tree_heap_print(&info);
+    printf("free: %ld\n", tree_regions[0]->lists.free_space);
+    int *ptr = tree_alloc(&info, sizeof(int));
+    tree_heap_print(&info);
+    printf("free: %ld\n", tree_regions[0]->lists.free_space);
     printf("%p\n", ptr);
     *ptr = 32;
     printf("%d\n", *ptr);
     /* Increase by 1 to force allocator to go left instead of right */
-    int *ptr2 = tree_alloc(262144);
-    tree_heap_print();
-    printf("free: %ld\n", free_tree->free_space);
+    int *ptr2 = tree_alloc(&info, 262144);
+    tree_heap_print(&info);
+    printf("free: %ld\n", tree_regions[0]->lists.free_space);
     printf("%p\n", ptr);
-    tree_free(ptr);
-    tree_heap_print();
-    printf("free: %ld\n", free_tree->free_space);
-    tree_free(ptr2);
-    printf("free: %ld\n", free_tree->free_space);
+    tree_free(&info, ptr);
+    tree_heap_print(&info);
+    printf("free: %ld\n", tree_regions[0]->lists.free_space);
+    tree_free(&info, ptr2);
+    printf("free: %ld\n", tree_regions[0]->lists.free_space);
+    heap_unmap_region(heap, 1024 * 1024);
 }